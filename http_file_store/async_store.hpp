@@ -0,0 +1,276 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <thread>
+#include <mutex>
+#include <future>
+#include <functional>
+#include <stdexcept>
+#include <condition_variable>
+#include "file_store.hpp"
+#include "queue_store.hpp"
+
+namespace timax
+{
+	struct async_options
+	{
+		size_t						workers = 4;
+		size_t						queue_capacity = 1024;		// per worker
+		bool						block_when_full = true;		// false fails the call instead
+	};
+
+	class submission_queue_full : public std::runtime_error
+	{
+	public:
+		submission_queue_full()
+			: std::runtime_error{ "Async submission queue is full." }
+		{
+		}
+	};
+
+	/* bounded worker pool, tasks submitted with the same key run in submission order on one worker */
+	class ordered_executor
+	{
+		using task_t = std::function<void()>;
+
+		struct worker
+		{
+			std::mutex					mutex;
+			std::condition_variable		not_empty;
+			std::condition_variable		not_full;
+			std::deque<task_t>			tasks;
+			bool						stopping = false;
+			std::thread					thread;
+		};
+
+	public:
+		explicit ordered_executor(async_options const& options)
+			: options_(options)
+		{
+			auto count = std::max<size_t>(options_.workers, 1);
+			workers_.reserve(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				workers_.push_back(std::make_unique<worker>());
+				auto w = workers_.back().get();
+				w->thread = std::thread{ [w] { run(*w); } };
+			}
+		}
+
+		~ordered_executor()
+		{
+			// run what is queued, then stop
+			for (auto& w : workers_)
+			{
+				{
+					std::lock_guard<std::mutex> lock{ w->mutex };
+					w->stopping = true;
+				}
+				w->not_empty.notify_one();
+			}
+
+			for (auto& w : workers_)
+				w->thread.join();
+		}
+
+		ordered_executor(ordered_executor const&) = delete;
+		ordered_executor& operator= (ordered_executor const&) = delete;
+
+		// false if the queue of the worker is full and the executor does not block
+		bool submit(size_t key, task_t task)
+		{
+			auto& w = *workers_[key % workers_.size()];
+			std::unique_lock<std::mutex> lock{ w.mutex };
+			auto has_room = [this, &w] { return w.stopping || w.tasks.size() < options_.queue_capacity; };
+			if (options_.block_when_full)
+				w.not_full.wait(lock, has_room);
+			else if (!has_room())
+				return false;
+
+			if (w.stopping)
+				return false;
+
+			w.tasks.push_back(std::move(task));
+			lock.unlock();
+			w.not_empty.notify_one();
+			return true;
+		}
+
+	private:
+		static void run(worker& w)
+		{
+			std::unique_lock<std::mutex> lock{ w.mutex };
+			for (;;)
+			{
+				w.not_empty.wait(lock, [&w] { return w.stopping || !w.tasks.empty(); });
+				if (w.tasks.empty())
+					return;
+
+				auto task = std::move(w.tasks.front());
+				w.tasks.pop_front();
+				lock.unlock();
+				w.not_full.notify_one();
+
+				// an exception would end the worker thread and the process with it
+				try
+				{
+					task();
+				}
+				catch (...)
+				{
+				}
+				lock.lock();
+			}
+		}
+
+	private:
+		async_options const					options_;
+		std::vector<std::unique_ptr<worker>>	workers_;
+	};
+
+	namespace detail
+	{
+		// run f on the executor and hand its result, or its exception, to a future
+		template <typename F>
+		auto submit_for_future(ordered_executor& executor, size_t key, F&& f)
+		{
+			using result_t = decltype(f());
+			auto task = std::make_shared<std::packaged_task<result_t()>>(std::forward<F>(f));
+			auto result = task->get_future();
+			if (!executor.submit(key, [task] { (*task)(); }))
+			{
+				std::promise<result_t> rejected;
+				rejected.set_exception(std::make_exception_ptr(submission_queue_full{}));
+				return rejected.get_future();
+			}
+			return result;
+		}
+	}
+
+	/* queue_store calls on a worker pool, calls for one topic keep their order */
+	class async_queue_store
+	{
+	public:
+		using push_callback_t = std::function<void(bool)>;
+		using get_callback_t = std::function<void(bool, std::string)>;
+
+		async_queue_store(queue_store& store, async_options const& options = async_options{})
+			: store_(store)
+			, executor_(options)
+		{
+		}
+
+		std::future<bool> async_push_back(std::string topic, std::string value)
+		{
+			auto key = hash_(topic);
+			return detail::submit_for_future(executor_, key,
+				[this, topic = std::move(topic), value = std::move(value)]
+			{
+				return store_.push_back(topic, value);
+			});
+		}
+
+		// callback runs on a worker, or right here with false when the submission is rejected;
+		// a call that throws is reported as false as well
+		void async_push_back(std::string topic, std::string value, push_callback_t callback)
+		{
+			auto key = hash_(topic);
+			auto task = [this, topic = std::move(topic), value = std::move(value), callback]
+			{
+				auto ok = false;
+				try
+				{
+					ok = store_.push_back(topic, value);
+				}
+				catch (std::exception const&)
+				{
+				}
+				if (callback)
+					callback(ok);
+			};
+
+			if (!executor_.submit(key, std::move(task)) && callback)
+				callback(false);
+		}
+
+		// the JSON array of get_message, a failed read throws from the future
+		std::future<std::string> async_get_message(std::string topic, index_type begin, index_type end)
+		{
+			auto key = hash_(topic);
+			return detail::submit_for_future(executor_, key, [this, topic = std::move(topic), begin, end]
+			{
+				std::string value;
+				if (!store_.get_message(topic, begin, end, value))
+					throw std::runtime_error{ "Failed to read messages of " + topic };
+				return value;
+			});
+		}
+
+		void async_get_message(std::string topic, index_type begin, index_type end, get_callback_t callback)
+		{
+			auto key = hash_(topic);
+			auto task = [this, topic = std::move(topic), begin, end, callback]
+			{
+				std::string value;
+				auto ok = false;
+				try
+				{
+					ok = store_.get_message(topic, begin, end, value);
+				}
+				catch (std::exception const&)
+				{
+					value.clear();
+				}
+				if (callback)
+					callback(ok, std::move(value));
+			};
+
+			if (!executor_.submit(key, std::move(task)) && callback)
+				callback(false, std::string{});
+		}
+
+	private:
+		queue_store&					store_;
+		std::hash<std::string>			hash_;
+		ordered_executor				executor_;
+	};
+
+	/* file_store calls on a worker pool, calls for one key keep their order */
+	class async_file_store
+	{
+	public:
+		async_file_store(file_store& store, async_options const& options = async_options{})
+			: store_(store)
+			, executor_(options)
+		{
+		}
+
+		std::future<void> async_put(std::string key, std::string value)
+		{
+			auto worker_key = hash_(key);
+			return detail::submit_for_future(executor_, worker_key,
+				[this, key = std::move(key), value = std::move(value)]
+			{
+				store_.put(key, value);
+			});
+		}
+
+		std::future<std::string> async_get(std::string key)
+		{
+			auto worker_key = hash_(key);
+			return detail::submit_for_future(executor_, worker_key, [this, key = std::move(key)]
+			{
+				return store_.get(key);
+			});
+		}
+
+	private:
+		file_store&						store_;
+		std::hash<std::string>			hash_;
+		ordered_executor				executor_;
+	};
+}
\ No newline at end of file
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+namespace timax
+{
+	inline void encode_fixed_32(char* dst, uint64_t value)
+	{
+		dst[0] = value & 0xff;
+		dst[1] = (value >> 8) & 0xff;
+		dst[2] = (value >> 16) & 0xff;
+		dst[3] = (value >> 24) & 0xff;
+	}
+
+	inline void encode_fixed_64(char* dst, uint64_t value)
+	{
+		dst[0] = value & 0xff;
+		dst[1] = (value >> 8) & 0xff;
+		dst[2] = (value >> 16) & 0xff;
+		dst[3] = (value >> 24) & 0xff;
+		dst[4] = (value >> 32) & 0xff;
+		dst[5] = (value >> 40) & 0xff;
+		dst[6] = (value >> 48) & 0xff;
+		dst[7] = (value >> 56) & 0xff;
+	}
+
+	inline uint32_t decode_fixed_32(char const* ptr)
+	{
+		return ((static_cast<uint32_t>(static_cast<unsigned char>(ptr[0])))
+			| (static_cast<uint32_t>(static_cast<unsigned char>(ptr[1])) << 8)
+			| (static_cast<uint32_t>(static_cast<unsigned char>(ptr[2])) << 16)
+			| (static_cast<uint32_t>(static_cast<unsigned char>(ptr[3])) << 24));
+	}
+
+	inline uint64_t decode_fixed_64(char const* ptr)
+	{
+		uint64_t const lo = decode_fixed_32(ptr);
+		uint64_t const hi = decode_fixed_32(ptr + 4);
+		return (hi << 32) | lo;
+	}
+
+	inline void put_fixed_32(std::string* dst, uint32_t value)
+	{
+		char buf[sizeof(value)];
+		encode_fixed_32(buf, value);
+		dst->append(buf, sizeof(buf));
+	}
+
+	inline void put_fixed_64(std::string* dst, uint64_t value)
+	{
+		char buf[sizeof(value)];
+		encode_fixed_64(buf, value);
+		dst->append(buf, sizeof(buf));
+	}
+
+	namespace detail
+	{
+		// big endian keeps the byte order of keys equal to the order of indexes
+		inline void encode_big_endian_64(char* dst, uint64_t value)
+		{
+			for (int i = 7; i >= 0; --i, value >>= 8)
+				dst[i] = static_cast<char>(value & 0xff);
+		}
+
+		inline uint64_t decode_big_endian_64(char const* ptr)
+		{
+			uint64_t value = 0;
+			for (int i = 0; i < 8; ++i)
+				value = (value << 8) | static_cast<unsigned char>(ptr[i]);
+			return value;
+		}
+	}
+}
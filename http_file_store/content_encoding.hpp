@@ -0,0 +1,434 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cctype>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+
+// zstd and lz4 are optional, each is there when its header is (and the library is linked)
+#if !defined(TIMAX_NO_ZSTD) && __has_include(<zstd.h>)
+#include <zstd.h>
+#define TIMAX_HAS_ZSTD 1
+#endif
+
+#if !defined(TIMAX_NO_LZ4) && __has_include(<lz4frame.h>)
+#include <lz4frame.h>
+#define TIMAX_HAS_LZ4 1
+#endif
+
+namespace timax
+{
+	// Content-Encoding tokens, identity is the empty string
+	static char const zstd_encoding[] = "zstd";
+	static char const lz4_encoding[] = "lz4";
+
+	// the extension of name with its dot, empty if it has none
+	inline std::string file_extension(std::string const& name)
+	{
+		auto pos = name.rfind('.');
+		if (std::string::npos == pos || std::string::npos != name.find_first_of("/\\", pos))
+			return std::string{};
+		return name.substr(pos);
+	}
+
+	// media that are compressed already, compressing them again only burns cpu
+	inline bool is_compressed_media(std::string const& name)
+	{
+		static char const* const extensions[] =
+		{
+			".gif", ".jpg", ".jpeg", ".png", ".webp", ".avif", ".heic",
+			".mp3", ".mp4", ".m4a", ".mkv", ".webm", ".mov", ".ogg",
+			".zip", ".gz", ".tgz", ".bz2", ".xz", ".7z", ".rar", ".zst", ".lz4", ".br",
+		};
+
+		auto extension = file_extension(name);
+		std::transform(extension.begin(), extension.end(), extension.begin(),
+			[](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		return std::any_of(std::begin(extensions), std::end(extensions),
+			[&extension](char const* e) { return extension == e; });
+	}
+
+	inline bool encoding_supported(std::string const& encoding)
+	{
+#ifdef TIMAX_HAS_ZSTD
+		if (zstd_encoding == encoding)
+			return true;
+#endif
+#ifdef TIMAX_HAS_LZ4
+		if (lz4_encoding == encoding)
+			return true;
+#endif
+		return encoding.empty();
+	}
+
+	// whether an Accept-Encoding list takes encoding, "*" takes all and q=0 refuses
+	inline bool accepts_encoding(std::string const& accept, std::string const& encoding)
+	{
+		if (encoding.empty())
+			return true;
+
+		size_t begin = 0;
+		while (begin < accept.size())
+		{
+			auto end = std::min(accept.find(',', begin), accept.size());
+			auto item = accept.substr(begin, end - begin);
+			begin = end + 1;
+
+			auto params = item.find(';');
+			auto token = item.substr(0, params);
+			token.erase(std::remove_if(token.begin(), token.end(),
+				[](unsigned char c) { return std::isspace(c); }), token.end());
+			if (token != encoding && token != "*")
+				continue;
+
+			auto q = std::string::npos == params ? std::string::npos : item.find("q=", params);
+			return std::string::npos == q || std::strtod(item.c_str() + q + 2, nullptr) > 0;
+		}
+		return false;
+	}
+
+	/* streaming compressor of one zstd or lz4 frame */
+	class content_encoder
+	{
+		static constexpr size_t lz4_block_size = 64 << 10;
+
+	public:
+		content_encoder(std::string const& encoding, int level)
+			: encoding_(encoding)
+		{
+#ifdef TIMAX_HAS_ZSTD
+			if (zstd_encoding == encoding_)
+			{
+				zstd_.reset(ZSTD_createCCtx());
+				if (!zstd_)
+					throw std::runtime_error{ "Failed to create zstd context." };
+				ZSTD_CCtx_setParameter(zstd_.get(), ZSTD_c_compressionLevel, level);
+				return;
+			}
+#endif
+#ifdef TIMAX_HAS_LZ4
+			if (lz4_encoding == encoding_)
+			{
+				LZ4F_cctx* cctx = nullptr;
+				if (LZ4F_isError(LZ4F_createCompressionContext(&cctx, LZ4F_VERSION)))
+					throw std::runtime_error{ "Failed to create lz4 context." };
+				lz4_.reset(cctx);
+				std::memset(&lz4_prefs_, 0, sizeof(lz4_prefs_));
+				lz4_prefs_.compressionLevel = level;
+				return;
+			}
+#endif
+			(void)level;
+			throw std::runtime_error{ "Content encoding " + encoding_ + " is not supported." };
+		}
+
+		content_encoder(content_encoder const&) = delete;
+		content_encoder& operator= (content_encoder const&) = delete;
+
+		std::string const& encoding() const noexcept
+		{
+			return encoding_;
+		}
+
+		// compresses from [data, data + size) into out and moves data past what was taken;
+		// last says no input follows, 0 then means the frame is complete
+		size_t encode(char const*& data, size_t& size, bool last, char* out, size_t capacity)
+		{
+#ifdef TIMAX_HAS_ZSTD
+			if (zstd_)
+			{
+				ZSTD_inBuffer in{ data, size, 0 };
+				ZSTD_outBuffer output{ out, capacity, 0 };
+				while (output.pos < output.size && !finished_)
+				{
+					auto remaining = ZSTD_compressStream2(zstd_.get(), &output, &in, last ? ZSTD_e_end : ZSTD_e_continue);
+					if (ZSTD_isError(remaining))
+						throw std::runtime_error{ ZSTD_getErrorName(remaining) };
+					if (last)
+						finished_ = 0 == remaining;
+					else if (in.pos == in.size)
+						break;
+				}
+
+				data += in.pos;
+				size -= in.pos;
+				return output.pos;
+			}
+#endif
+#ifdef TIMAX_HAS_LZ4
+			// lz4 wants room for a whole block, blocks go through pending
+			size_t produced = 0;
+			while (produced < capacity)
+			{
+				if (pending_offset_ < pending_.size())
+				{
+					auto count = std::min(capacity - produced, pending_.size() - pending_offset_);
+					std::memcpy(out + produced, pending_.data() + pending_offset_, count);
+					pending_offset_ += count;
+					produced += count;
+					continue;
+				}
+
+				if (finished_ || (0 == size && !last && started_))
+					break;
+
+				pending_offset_ = 0;
+				size_t written = 0;
+				if (!started_)
+				{
+					pending_.resize(LZ4F_HEADER_SIZE_MAX);
+					written = LZ4F_compressBegin(lz4_.get(), &pending_[0], pending_.size(), &lz4_prefs_);
+					started_ = true;
+				}
+				else if (size > 0)
+				{
+					auto count = std::min(size, lz4_block_size);
+					pending_.resize(LZ4F_compressBound(count, &lz4_prefs_));
+					written = LZ4F_compressUpdate(lz4_.get(), &pending_[0], pending_.size(), data, count, nullptr);
+					data += count;
+					size -= count;
+				}
+				else
+				{
+					pending_.resize(LZ4F_compressBound(0, &lz4_prefs_));
+					written = LZ4F_compressEnd(lz4_.get(), &pending_[0], pending_.size(), nullptr);
+					finished_ = true;
+				}
+
+				if (LZ4F_isError(written))
+					throw std::runtime_error{ LZ4F_getErrorName(written) };
+				pending_.resize(written);
+			}
+			return produced;
+#else
+			(void)data, (void)size, (void)last, (void)out, (void)capacity;
+			return 0;
+#endif
+		}
+
+	private:
+#ifdef TIMAX_HAS_ZSTD
+		struct zstd_delete
+		{
+			void operator() (ZSTD_CCtx* cctx)
+			{
+				ZSTD_freeCCtx(cctx);
+			}
+		};
+		std::unique_ptr<ZSTD_CCtx, zstd_delete>		zstd_;
+#endif
+#ifdef TIMAX_HAS_LZ4
+		struct lz4_delete
+		{
+			void operator() (LZ4F_cctx* cctx)
+			{
+				LZ4F_freeCompressionContext(cctx);
+			}
+		};
+		std::unique_ptr<LZ4F_cctx, lz4_delete>		lz4_;
+		LZ4F_preferences_t							lz4_prefs_;
+		std::string									pending_;
+		size_t										pending_offset_ = 0;
+		bool										started_ = false;
+#endif
+		std::string									encoding_;
+		bool										finished_ = false;
+	};
+
+	/* checks an encoded payload as it streams by without keeping what it decodes to: it has to
+	   decode, to at most max_size bytes, and finish() throws if it stops in the middle of a frame */
+	class content_validator
+	{
+		static constexpr size_t scratch_size = 64 << 10;
+
+	public:
+		content_validator(std::string const& encoding, uint64_t max_size)
+			: encoding_(encoding)
+			, max_size_(max_size)
+			, scratch_(scratch_size, '\0')
+		{
+#ifdef TIMAX_HAS_ZSTD
+			if (zstd_encoding == encoding_)
+			{
+				zstd_.reset(ZSTD_createDCtx());
+				if (!zstd_)
+					throw std::runtime_error{ "Failed to create zstd context." };
+				return;
+			}
+#endif
+#ifdef TIMAX_HAS_LZ4
+			if (lz4_encoding == encoding_)
+			{
+				LZ4F_dctx* dctx = nullptr;
+				if (LZ4F_isError(LZ4F_createDecompressionContext(&dctx, LZ4F_VERSION)))
+					throw std::runtime_error{ "Failed to create lz4 context." };
+				lz4_.reset(dctx);
+				return;
+			}
+#endif
+			throw std::runtime_error{ "Content encoding " + encoding_ + " is not supported." };
+		}
+
+		content_validator(content_validator const&) = delete;
+		content_validator& operator= (content_validator const&) = delete;
+
+		void update(char const* data, size_t size)
+		{
+#ifdef TIMAX_HAS_ZSTD
+			if (zstd_)
+			{
+				ZSTD_inBuffer in{ data, size, 0 };
+				for (;;)
+				{
+					ZSTD_outBuffer out{ &scratch_[0], scratch_.size(), 0 };
+					pending_ = ZSTD_decompressStream(zstd_.get(), &out, &in);
+					if (ZSTD_isError(pending_))
+						throw std::runtime_error{ ZSTD_getErrorName(pending_) };
+					count(out.pos);
+					if (in.pos == in.size && (out.pos < out.size || 0 == pending_))
+						return;
+				}
+			}
+#endif
+#ifdef TIMAX_HAS_LZ4
+			if (lz4_)
+			{
+				size_t in_pos = 0;
+				for (;;)
+				{
+					auto in_size = size - in_pos;
+					auto out_size = scratch_.size();
+					pending_ = LZ4F_decompress(lz4_.get(), &scratch_[0], &out_size, data + in_pos, &in_size, nullptr);
+					if (LZ4F_isError(pending_))
+						throw std::runtime_error{ LZ4F_getErrorName(pending_) };
+					in_pos += in_size;
+					count(out_size);
+					if (in_pos == size && (out_size < scratch_.size() || 0 == pending_))
+						return;
+				}
+			}
+#endif
+			(void)data, (void)size;
+		}
+
+		void finish()
+		{
+			if (0 != pending_)
+				throw std::runtime_error{ "Truncated " + encoding_ + " content." };
+		}
+
+		uint64_t decoded_size() const noexcept
+		{
+			return decoded_;
+		}
+
+	private:
+		void count(size_t size)
+		{
+			decoded_ += size;
+			if (decoded_ > max_size_)
+				throw std::runtime_error{ "Content decodes to more than " + std::to_string(max_size_) + " bytes." };
+		}
+
+	private:
+#ifdef TIMAX_HAS_ZSTD
+		std::unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx*)>	zstd_{ nullptr, ZSTD_freeDCtx };
+#endif
+#ifdef TIMAX_HAS_LZ4
+		std::unique_ptr<LZ4F_dctx, LZ4F_errorCode_t(*)(LZ4F_dctx*)>	lz4_{ nullptr, LZ4F_freeDecompressionContext };
+#endif
+		std::string									encoding_;
+		uint64_t									max_size_;
+		std::string									scratch_;
+		uint64_t									decoded_ = 0;
+		size_t										pending_ = 1;		// 0 once a frame is complete
+	};
+
+	// the content of a whole zstd or lz4 payload, which must not decode to more than max_size bytes
+	inline std::string decode_content(std::string const& encoding, char const* data, size_t size,
+		uint64_t max_size = std::numeric_limits<uint64_t>::max())
+	{
+		auto too_large = [max_size]
+		{
+			return std::runtime_error{ "Content decodes to more than " + std::to_string(max_size) + " bytes." };
+		};
+
+		std::string value;
+#ifdef TIMAX_HAS_ZSTD
+		if (zstd_encoding == encoding)
+		{
+			// the declared size comes from whoever encoded the payload, it only bounds the first buffer
+			std::unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx*)> dctx{ ZSTD_createDCtx(), ZSTD_freeDCtx };
+			auto content_size = ZSTD_getFrameContentSize(data, size);
+			if (ZSTD_CONTENTSIZE_UNKNOWN != content_size && ZSTD_CONTENTSIZE_ERROR != content_size && content_size > max_size)
+				throw too_large();
+			value.resize(static_cast<size_t>(std::min<uint64_t>(max_size,
+				ZSTD_CONTENTSIZE_UNKNOWN != content_size && ZSTD_CONTENTSIZE_ERROR != content_size ?
+				content_size : std::max<size_t>(ZSTD_DStreamOutSize(), size * 4))));
+
+			ZSTD_inBuffer in{ data, size, 0 };
+			ZSTD_outBuffer out{ &value[0], value.size(), 0 };
+			for (;;)
+			{
+				if (out.pos == out.size)
+				{
+					if (value.size() >= max_size)
+						throw too_large();
+					value.resize(static_cast<size_t>(std::min<uint64_t>(max_size, std::max(value.size() * 2, ZSTD_DStreamOutSize()))));
+					out.dst = &value[0];
+					out.size = value.size();
+				}
+
+				// 0 ends a frame, more frames may follow
+				auto remaining = ZSTD_decompressStream(dctx.get(), &out, &in);
+				if (ZSTD_isError(remaining))
+					throw std::runtime_error{ ZSTD_getErrorName(remaining) };
+				if (in.pos == in.size && 0 == remaining)
+					break;
+				if (in.pos == in.size && out.pos < out.size)
+					throw std::runtime_error{ "Truncated zstd content." };
+			}
+			value.resize(out.pos);
+			return value;
+		}
+#endif
+#ifdef TIMAX_HAS_LZ4
+		if (lz4_encoding == encoding)
+		{
+			LZ4F_dctx* raw = nullptr;
+			if (LZ4F_isError(LZ4F_createDecompressionContext(&raw, LZ4F_VERSION)))
+				throw std::runtime_error{ "Failed to create lz4 context." };
+			std::unique_ptr<LZ4F_dctx, LZ4F_errorCode_t(*)(LZ4F_dctx*)> dctx{ raw, LZ4F_freeDecompressionContext };
+
+			value.resize(static_cast<size_t>(std::min<uint64_t>(max_size, std::max<size_t>(64 << 10, size * 4))));
+			size_t in_pos = 0, out_pos = 0, hint = 1;
+			while (0 != hint)
+			{
+				if (out_pos == value.size())
+				{
+					if (value.size() >= max_size)
+						throw too_large();
+					value.resize(static_cast<size_t>(std::min<uint64_t>(max_size, value.size() * 2)));
+				}
+
+				auto in_size = size - in_pos;
+				auto out_size = value.size() - out_pos;
+				hint = LZ4F_decompress(dctx.get(), &value[out_pos], &out_size, data + in_pos, &in_size, nullptr);
+				if (LZ4F_isError(hint))
+					throw std::runtime_error{ LZ4F_getErrorName(hint) };
+				in_pos += in_size;
+				out_pos += out_size;
+				if (0 != hint && in_pos == size && 0 == out_size)
+					throw std::runtime_error{ "Truncated lz4 content." };
+			}
+			value.resize(out_pos);
+			return value;
+		}
+#endif
+		(void)data, (void)size, (void)too_large;
+		throw std::runtime_error{ "Content encoding " + encoding + " is not supported." };
+	}
+}
@@ -0,0 +1,163 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <iterator>
+#include <algorithm>
+#include <functional>
+#include <unordered_map>
+
+namespace timax
+{
+	struct cache_stats
+	{
+		uint64_t					hits = 0;
+		uint64_t					misses = 0;
+		uint64_t					inserts = 0;
+		uint64_t					evictions = 0;
+		uint64_t					invalidations = 0;
+		size_t						entries = 0;
+		size_t						bytes = 0;
+	};
+
+	/* sharded LRU of immutable values bounded by bytes, readers of one key share one buffer */
+	class lru_cache
+	{
+	public:
+		using value_ptr = std::shared_ptr<std::string const>;
+
+	private:
+		// bookkeeping of an entry, charged on top of key and value
+		static constexpr size_t entry_overhead = 64;
+
+		using entry_t = std::pair<std::string, value_ptr>;
+		using lru_t = std::list<entry_t>;
+
+		struct shard
+		{
+			std::mutex					mutex;
+			lru_t						lru;			// most recently used first
+			std::unordered_map<std::string, lru_t::iterator>	index;
+			size_t						bytes = 0;
+			uint64_t					version = 0;	// bumped by every erase
+			cache_stats					stats;
+		};
+
+	public:
+		explicit lru_cache(size_t capacity, size_t shards = 16)
+			: shard_capacity_(capacity / std::max<size_t>(shards, 1))
+			, shards_(std::max<size_t>(shards, 1))
+		{
+		}
+
+		lru_cache(lru_cache const&) = delete;
+		lru_cache& operator= (lru_cache const&) = delete;
+
+		value_ptr find(std::string const& key)
+		{
+			auto& s = shard_of(key);
+			std::lock_guard<std::mutex> lock{ s.mutex };
+			auto itr = s.index.find(key);
+			if (s.index.end() == itr)
+			{
+				++s.stats.misses;
+				return nullptr;
+			}
+
+			++s.stats.hits;
+			s.lru.splice(s.lru.begin(), s.lru, itr->second);
+			return itr->second->second;
+		}
+
+		// take before loading a value, insert drops the value if key was erased in between
+		uint64_t version(std::string const& key)
+		{
+			auto& s = shard_of(key);
+			std::lock_guard<std::mutex> lock{ s.mutex };
+			return s.version;
+		}
+
+		void insert(std::string const& key, value_ptr value, uint64_t version)
+		{
+			auto charge = this->charge(key, *value);
+			if (charge > shard_capacity_)
+				return;
+
+			auto& s = shard_of(key);
+			std::lock_guard<std::mutex> lock{ s.mutex };
+			if (version != s.version)
+				return;
+
+			auto itr = s.index.find(key);
+			if (s.index.end() != itr)
+				remove(s, itr->second);
+
+			s.lru.emplace_front(key, std::move(value));
+			s.index.emplace(key, s.lru.begin());
+			s.bytes += charge;
+			++s.stats.inserts;
+
+			while (s.bytes > shard_capacity_)
+			{
+				remove(s, std::prev(s.lru.end()));
+				++s.stats.evictions;
+			}
+		}
+
+		void erase(std::string const& key)
+		{
+			auto& s = shard_of(key);
+			std::lock_guard<std::mutex> lock{ s.mutex };
+			++s.version;
+			auto itr = s.index.find(key);
+			if (s.index.end() != itr)
+			{
+				remove(s, itr->second);
+				++s.stats.invalidations;
+			}
+		}
+
+		cache_stats stats()
+		{
+			cache_stats total;
+			for (auto& s : shards_)
+			{
+				std::lock_guard<std::mutex> lock{ s.mutex };
+				total.hits += s.stats.hits;
+				total.misses += s.stats.misses;
+				total.inserts += s.stats.inserts;
+				total.evictions += s.stats.evictions;
+				total.invalidations += s.stats.invalidations;
+				total.entries += s.index.size();
+				total.bytes += s.bytes;
+			}
+			return total;
+		}
+
+	private:
+		static size_t charge(std::string const& key, std::string const& value) noexcept
+		{
+			return key.size() + value.size() + entry_overhead;
+		}
+
+		static void remove(shard& s, lru_t::iterator entry)
+		{
+			s.bytes -= charge(entry->first, *entry->second);
+			s.index.erase(entry->first);
+			s.lru.erase(entry);
+		}
+
+		shard& shard_of(std::string const& key)
+		{
+			return shards_[std::hash<std::string>{}(key) % shards_.size()];
+		}
+
+	private:
+		size_t const					shard_capacity_;
+		std::vector<shard>				shards_;
+	};
+}
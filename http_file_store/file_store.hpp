@@ -4,11 +4,28 @@
 #include <memory>
 #include <thread>
 #include <sstream>
+#include <vector>
+#include <limits>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <mutex>
+#include <shared_mutex>
+#include <chrono>
+#include <functional>
+#include <boost/crc.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/uuid/uuid_io.hpp>				// for lexical cast
 #include <boost/uuid/name_generator.hpp>
 #include <boost/uuid/string_generator.hpp>
+#include <boost/uuid/detail/sha1.hpp>
 #include <rocksdb/db.h>
+#include <rocksdb/write_batch.h>
+#include <rocksdb/statistics.h>
+#include <rocksdb/version.h>
+#include "coding.hpp"
+#include "file_cache.hpp"
+#include "content_encoding.hpp"
 
 namespace timax
 {
@@ -31,32 +48,812 @@ namespace timax
 		boost::uuids::uuid const			seed_;
 	};
 
+	/* integrated BlobDB for the payload column families: values from min_blob_size on go to blob
+	   files and leave the LSM, so compactions stop rewriting them; manifests stay in the LSM */
+	struct blob_options
+	{
+		bool						enabled = false;
+		uint64_t					min_blob_size = 64 << 10;
+		uint64_t					blob_file_size = 256 << 20;
+		bool						compression = false;		// images and archives are compressed already
+		bool						garbage_collection = true;
+		double						garbage_collection_age_cutoff = 0.25;	// oldest part of the blob files relocated
+		double						garbage_collection_force_threshold = 1.0;
+	};
+
+	struct file_store_options
+	{
+		size_t						chunk_size = 1 << 20;		// larger values are split into chunks of this size
+		blob_options				blob;
+		std::shared_ptr<rocksdb::Statistics>	statistics;		// DBOptions::statistics if set
+
+		// content addressed: names map to the sha1 of their content, which is stored once
+		bool						deduplicate = false;
+
+		// read-through cache of get, 0 disables it
+		size_t						cache_size = 0;				// bytes
+		size_t						cache_max_value_size = 256 << 10;	// larger files are not cached
+
+		// payloads put with a zstd or lz4 encoding are kept as sent, readers that do not take
+		// the encoding get them decoded; encoded payloads are not cached
+		bool						content_encoding = false;
+		uint64_t					max_decoded_size = 1ull << 30;	// an encoded payload decoding to more is refused
+	};
+
+	/* record of a chunked file, its chunks are <object>/<chunk#> in a column family of their own,
+	   object is the key of the file itself when empty */
+	struct file_manifest
+	{
+		static constexpr size_t static_size = 2 * sizeof(uint64_t);
+
+		uint64_t					size = 0;
+		uint64_t					chunk_size = 0;
+		std::string					object;
+
+		uint64_t chunks() const noexcept
+		{
+			return 0 == chunk_size ? 0 : (size + chunk_size - 1) / chunk_size;
+		}
+
+		std::string encode() const
+		{
+			std::string value;
+			value.reserve(static_size + object.size());
+			put_fixed_64(&value, size);
+			put_fixed_64(&value, chunk_size);
+			value.append(object);
+			return value;
+		}
+
+		static bool decode(rocksdb::Slice const& value, file_manifest& manifest)
+		{
+			if (value.size() < static_size)
+				return false;
+
+			manifest.size = decode_fixed_64(value.data());
+			manifest.chunk_size = decode_fixed_64(value.data() + sizeof(uint64_t));
+			manifest.object.assign(value.data() + static_size, value.size() - static_size);
+			return manifest.chunk_size > 0;
+		}
+	};
+
+	/* progress of a resumable upload, missing holds the indexes of the chunks not received yet */
+	struct upload_status
+	{
+		std::string					name;
+		uint64_t					size = 0;
+		uint64_t					chunk_size = 0;
+		std::vector<uint64_t>		missing;
+	};
+
+	namespace detail
+	{
+		// crc-32 (the zlib one) of a resumable upload chunk
+		inline uint32_t upload_crc32(char const* data, size_t size)
+		{
+			boost::crc_32_type crc;
+			crc.process_bytes(data, size);
+			return crc.checksum();
+		}
+
+		// the 20 bytes of a sha1 digest, whatever word type the boost version hands out
+		inline std::string sha1_digest(boost::uuids::detail::sha1& sha1)
+		{
+			boost::uuids::detail::sha1::digest_type digest;
+			sha1.get_digest(digest);
+
+			std::string hash;
+			for (auto word : digest)
+			{
+				for (auto shift = static_cast<int>(sizeof(word) - 1) * 8; shift >= 0; shift -= 8)
+					hash.push_back(static_cast<char>((word >> shift) & 0xff));
+			}
+			return hash;
+		}
+	}
+
+	class file_store;
+
+	/* streams a file into chunks as it arrives, at most one chunk is buffered; the chunks are staged
+	   under a key of their own and the file switches to them when close() writes its manifest,
+	   a writer destroyed before that drops the staged chunks and leaves the file as it was */
+	class file_writer
+	{
+		friend class file_store;
+
+	public:
+		file_writer(file_writer&& other) noexcept
+			: store_(std::exchange(other.store_, nullptr))
+			, key_(std::move(other.key_))
+			, staged_(std::move(other.staged_))
+			, chunk_size_(other.chunk_size_)
+			, buffer_(std::move(other.buffer_))
+			, chunks_(other.chunks_)
+			, size_(other.size_)
+			, name_(std::move(other.name_))
+			, sha1_(other.sha1_)
+			, encoding_(std::move(other.encoding_))
+			, validator_(std::move(other.validator_))
+		{
+		}
+
+		file_writer(file_writer const&) = delete;
+		file_writer& operator= (file_writer const&) = delete;
+		file_writer& operator= (file_writer&&) = delete;
+
+		~file_writer();
+
+		void write(char const* data, size_t size);
+
+		void write(std::string const& data)
+		{
+			write(data.data(), data.size());
+		}
+
+		void close();
+
+		uint64_t size() const noexcept
+		{
+			return size_;
+		}
+
+	private:
+		// a name makes the writer hash the content and link name to it on close, key is then the staged object
+		file_writer(file_store& store, std::string key, std::string staged, size_t chunk_size,
+			std::string name = std::string{})
+			: store_(&store)
+			, key_(std::move(key))
+			, staged_(std::move(staged))
+			, chunk_size_(std::max<size_t>(chunk_size, 1))
+			, name_(std::move(name))
+		{
+			buffer_.reserve(chunk_size_);
+		}
+
+	private:
+		file_store*					store_;
+		std::string					key_;
+		std::string					staged_;
+		size_t						chunk_size_;
+		std::string					buffer_;
+		uint64_t					chunks_ = 0;
+		uint64_t					size_ = 0;
+		std::string					name_;
+		boost::uuids::detail::sha1	sha1_;
+		std::string					encoding_;
+		std::unique_ptr<content_validator>	validator_;		// of what comes from outside encoded
+	};
+
 	class file_store
 	{
+		friend class file_writer;
 		static constexpr size_t file_reserve_size = 48;
+		static constexpr size_t lock_stripes = 16;
+		using column_family_handles_t = std::vector<rocksdb::ColumnFamilyHandle*>;
+
+		// reference count and object key of a content hash
+		struct content_record
+		{
+			uint64_t				refs = 0;
+			std::string				object;
+
+			std::string encode() const
+			{
+				std::string value;
+				value.reserve(sizeof(uint64_t) + object.size());
+				put_fixed_64(&value, refs);
+				value.append(object);
+				return value;
+			}
+
+			static bool decode(rocksdb::Slice const& value, content_record& record)
+			{
+				if (value.size() <= sizeof(uint64_t))
+					return false;
+
+				record.refs = decode_fixed_64(value.data());
+				record.object.assign(value.data() + sizeof(uint64_t), value.size() - sizeof(uint64_t));
+				return true;
+			}
+		};
+
+		// a resumable upload, its chunks are staged as upload:<id>/<chunk#>
+		struct upload_session
+		{
+			uint64_t				size = 0;
+			uint64_t				chunk_size = 0;
+			std::string				name;
+
+			uint64_t chunks() const noexcept
+			{
+				return (size + chunk_size - 1) / chunk_size;
+			}
+
+			std::string encode() const
+			{
+				std::string value;
+				value.reserve(2 * sizeof(uint64_t) + name.size());
+				put_fixed_64(&value, size);
+				put_fixed_64(&value, chunk_size);
+				value.append(name);
+				return value;
+			}
+
+			static bool decode(rocksdb::Slice const& value, upload_session& session)
+			{
+				if (value.size() < 2 * sizeof(uint64_t))
+					return false;
+
+				session.size = decode_fixed_64(value.data());
+				session.chunk_size = decode_fixed_64(value.data() + sizeof(uint64_t));
+				session.name.assign(value.data() + 2 * sizeof(uint64_t), value.size() - 2 * sizeof(uint64_t));
+				return session.chunk_size > 0;
+			}
+		};
 
 	public:
-		explicit file_store(std::string const& path)
+		explicit file_store(std::string const& path, file_store_options const& options = file_store_options{})
+			: options_(options)
 		{
 			init(path);
+
+			if (options_.cache_size > 0)
+				cache_ = std::make_unique<lru_cache>(options_.cache_size);
 		}
 
+		~file_store()
+		{
+			if (db_)
+			{
+				for (auto handle : handles_)
+				{
+					if (handle)
+						db_->DestroyColumnFamilyHandle(handle);
+				}
+			}
+		}
+
+		file_store(file_store const&) = delete;
+		file_store& operator= (file_store const&) = delete;
+
+		// values above the chunk size are stored as a chunked file; with deduplication
+		// a content that is stored already is only referenced
 		void put(std::string const& key, std::string const& value)
 		{
-			auto s = db_->Put(rocksdb::WriteOptions{}, key, value);
-			if (!s.ok())
-				throw std::runtime_error{ s.getState() };
+			put(key, value, std::string{});
+		}
+
+		// value encoded with encoding (a Content-Encoding) is stored as it is
+		void put(std::string const& key, std::string const& value, std::string const& encoding)
+		{
+			check_encoding(encoding);
+			if (!encoding.empty())
+			{
+				content_validator validator{ encoding, options_.max_decoded_size };
+				validator.update(value.data(), value.size());
+				validator.finish();
+			}
+
+			if (!options_.deduplicate)
+			{
+				put_object(key, value, encoding);
+			}
+			else
+			{
+				boost::uuids::detail::sha1 sha1;
+				sha1.process_bytes(value.data(), value.size());
+				link(key, detail::sha1_digest(sha1), std::string{}, &value, encoding);
+			}
+			invalidate(key);
 		}
 
 		std::string get(std::string const& key)
 		{
-			std::string value;
-			auto s = db_->Get(rocksdb::ReadOptions{}, key, &value);
-			if (!s.ok())
-				throw std::runtime_error{ s.getState() };
+			std::string encoding;
+			return get(key, std::string{}, encoding);
+		}
+
+		// the payload as stored if accept (an Accept-Encoding) takes its encoding, else decoded;
+		// encoding is set to what the result is encoded with
+		std::string get(std::string const& key, std::string const& accept, std::string& encoding)
+		{
+			auto value = cache_ ? *fetch(key, encoding) : load(key, encoding);
+			if (!accepts_encoding(accept, encoding))
+			{
+				value = decode_content(encoding, value.data(), value.size(), options_.max_decoded_size);
+				encoding.clear();
+			}
+			return value;
+		}
+
+		// the cached buffer of key, concurrent readers share it; a copy of get without the cache
+		std::shared_ptr<std::string const> get_shared(std::string const& key)
+		{
+			std::string encoding;
+			auto value = cache_ ? fetch(key, encoding) : std::make_shared<std::string const>(load(key, encoding));
+			if (!encoding.empty())
+				return std::make_shared<std::string const>(decode_content(encoding, value->data(), value->size(), options_.max_decoded_size));
 			return value;
 		}
 
+		// get of many keys with one MultiGet per column family on the way instead of lookups one by one;
+		// statuses[i] is OK with the content in values[i], NotFound or the error of keys[i], nothing is thrown
+		void multi_get(std::string const* keys, size_t count, std::string* values, rocksdb::Status* statuses)
+		{
+			// names, contents, encodings, payloads and chunks from one snapshot
+			auto snapshot = take_snapshot();
+			rocksdb::ReadOptions op;
+			op.snapshot = snapshot.get();
+#if ROCKSDB_MAJOR >= 7
+			op.async_io = true;		// overlaps the reads of a batch where the platform supports it
+#endif
+
+			std::vector<size_t> pending;
+			std::vector<uint64_t> versions(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				values[i].clear();
+				statuses[i] = rocksdb::Status::OK();
+				if (cache_)
+				{
+					if (auto value = cache_->find(keys[i]))
+					{
+						values[i] = *value;
+						continue;
+					}
+					versions[i] = cache_->version(keys[i]);
+				}
+				pending.push_back(i);
+			}
+
+			auto fail = [statuses](size_t i, rocksdb::Status const& s)
+			{
+				statuses[i] = s;
+				return false;
+			};
+
+			// one MultiGet in handle for the pending keys, visit(i, status, value) -> bool keeps key i pending
+			auto batch = [this, &op, &pending](rocksdb::ColumnFamilyHandle* handle, std::vector<std::string> const& source,
+				auto&& visit)
+			{
+				if (pending.empty())
+					return;
+
+				std::vector<rocksdb::Slice> lookup;
+				lookup.reserve(pending.size());
+				for (auto i : pending)
+					lookup.emplace_back(source[i]);
+
+				std::vector<rocksdb::PinnableSlice> found(pending.size());
+				std::vector<rocksdb::Status> found_statuses(pending.size());
+				db_->MultiGet(op, handle, lookup.size(), lookup.data(), found.data(), found_statuses.data());
+
+				size_t kept = 0;
+				for (size_t j = 0; j < pending.size(); ++j)
+				{
+					if (visit(pending[j], found_statuses[j], found[j]))
+						pending[kept++] = pending[j];
+				}
+				pending.resize(kept);
+			};
+
+			// names to objects
+			std::vector<std::string> objects(keys, keys + count);
+			if (options_.deduplicate)
+			{
+				std::vector<std::string> hashes(count);
+				batch(file_names_handle_, objects, [&](size_t i, rocksdb::Status const& s, rocksdb::PinnableSlice const& hash)
+				{
+					if (!s.ok())
+						return fail(i, s);
+					hashes[i] = hash.ToString();
+					return true;
+				});
+
+				batch(file_content_handle_, hashes, [&](size_t i, rocksdb::Status const& s, rocksdb::PinnableSlice const& value)
+				{
+					content_record record;
+					if (!s.ok())
+						return fail(i, s);
+					if (!content_record::decode(value, record))
+						return fail(i, rocksdb::Status::Corruption("Corrupted content record of " + object_key(hashes[i])));
+					objects[i] = std::move(record.object);
+					return true;
+				});
+			}
+
+			std::vector<std::string> encodings(count);
+			if (options_.content_encoding)
+			{
+				batch(file_encodings_handle_, objects, [&](size_t i, rocksdb::Status const& s, rocksdb::PinnableSlice const& value)
+				{
+					if (s.ok())
+						encodings[i] = value.ToString();
+					else if (!s.IsNotFound())
+						return fail(i, s);
+					return true;
+				});
+			}
+
+			// plain objects, the others may be chunked files
+			std::vector<size_t> loaded;
+			batch(db_->DefaultColumnFamily(), objects, [&](size_t i, rocksdb::Status const& s, rocksdb::PinnableSlice const& value)
+			{
+				if (s.IsNotFound())
+					return true;
+				if (!s.ok())
+					return fail(i, s);
+				values[i].assign(value.data(), value.size());
+				loaded.push_back(i);
+				return false;
+			});
+
+			batch(file_meta_handle_, objects, [&](size_t i, rocksdb::Status const& s, rocksdb::PinnableSlice const& value)
+			{
+				file_manifest manifest;
+				if (!s.ok())
+					return fail(i, s);
+				if (!file_manifest::decode(value, manifest))
+					return fail(i, rocksdb::Status::Corruption("Corrupted manifest of " + objects[i]));
+
+				try
+				{
+					auto& content = values[i];
+					content.reserve(manifest.size);
+					read_object(op, objects[i], 0, std::numeric_limits<uint64_t>::max(), [&content](rocksdb::Slice const& chunk)
+					{
+						content.append(chunk.data(), chunk.size());
+						return true;
+					});
+				}
+				catch (std::exception const& e)
+				{
+					values[i].clear();
+					return fail(i, rocksdb::Status::IOError(e.what()));
+				}
+				loaded.push_back(i);
+				return false;
+			});
+
+			for (auto i : loaded)
+			{
+				if (encodings[i].empty())
+				{
+					if (cache_ && values[i].size() <= options_.cache_max_value_size)
+						cache_->insert(keys[i], std::make_shared<std::string const>(values[i]), versions[i]);
+					continue;
+				}
+
+				try
+				{
+					values[i] = decode_content(encodings[i], values[i].data(), values[i].size(), options_.max_decoded_size);
+				}
+				catch (std::exception const& e)
+				{
+					values[i].clear();
+					fail(i, rocksdb::Status::Corruption(e.what()));
+				}
+			}
+		}
+
+		std::vector<rocksdb::Status> multi_get(std::vector<std::string> const& keys, std::vector<std::string>& values)
+		{
+			values.resize(keys.size());
+			std::vector<rocksdb::Status> statuses(keys.size());
+			multi_get(keys.data(), keys.size(), values.data(), statuses.data());
+			return statuses;
+		}
+
+		// get that reports a miss or an error in its status instead of throwing; value pins the block or
+		// the cached buffer holding a plain file rather than copying it, chunked and encoded files are
+		// put together in its own buffer; a miss does not fill the cache
+		rocksdb::Status try_get(std::string const& key, rocksdb::PinnableSlice& value)
+		{
+			value.Reset();
+			if (cache_)
+			{
+				if (auto cached = cache_->find(key))
+				{
+					// the buffer lives as long as value pins it
+					auto holder = new std::shared_ptr<std::string const>(std::move(cached));
+					value.PinSlice(rocksdb::Slice{ **holder }, [](void* arg, void*)
+					{
+						delete static_cast<std::shared_ptr<std::string const>*>(arg);
+					}, holder, nullptr);
+					return rocksdb::Status::OK();
+				}
+			}
+
+			try
+			{
+				auto object = key;
+				if (options_.deduplicate && !resolve(key, object))
+					return rocksdb::Status::NotFound();
+
+				// the encoding and the payload from one snapshot
+				auto snapshot = take_snapshot();
+				rocksdb::ReadOptions op;
+				op.snapshot = snapshot.get();
+				auto encoding = encoding_of(op, object);
+				auto s = db_->Get(op, db_->DefaultColumnFamily(), object, &value);
+				if (s.IsNotFound())
+				{
+					file_manifest manifest;
+					if (!stat(op, object, manifest))
+						return s;
+
+					auto content = value.GetSelf();
+					content->clear();
+					content->reserve(manifest.size);
+					read_object(op, object, 0, std::numeric_limits<uint64_t>::max(), [content](rocksdb::Slice const& chunk)
+					{
+						content->append(chunk.data(), chunk.size());
+						return true;
+					});
+					value.PinSelf();
+				}
+				else if (!s.ok())
+				{
+					return s;
+				}
+
+				if (!encoding.empty())
+				{
+					auto decoded = decode_content(encoding, value.data(), value.size(), options_.max_decoded_size);
+					value.Reset();
+					*value.GetSelf() = std::move(decoded);
+					value.PinSelf();
+				}
+				return rocksdb::Status::OK();
+			}
+			catch (std::exception const& e)
+			{
+				value.Reset();
+				return rocksdb::Status::IOError(e.what());
+			}
+		}
+
+		// the encoding of the bytes stat and read deliver for key, empty for identity
+		std::string get_encoding(std::string const& key) const
+		{
+			auto object = key;
+			if (options_.deduplicate && !resolve(key, object))
+				throw std::runtime_error{ "File " + key + " not found." };
+			return encoding_of(rocksdb::ReadOptions{}, object);
+		}
+
+		cache_stats get_cache_stats() const
+		{
+			return cache_ ? cache_->stats() : cache_stats{};
+		}
+
+		file_writer open_writer(std::string const& key, std::string const& encoding = std::string{})
+		{
+			check_encoding(encoding);
+			if (!options_.deduplicate)
+				return with_encoding({ *this, key, staging_key(key), options_.chunk_size }, encoding);
+
+			// the object gets a name of its own, the hash is only known at the end
+			return with_encoding({ *this, upload_key(unique_id(key)), staging_key(key), options_.chunk_size, key }, encoding);
+		}
+
+		// starts a resumable upload of size bytes to name and returns its id; chunks of chunk_size bytes
+		// (the last one shorter) may then come in any order, in parallel and more than once
+		std::string begin_upload(std::string const& name, uint64_t size)
+		{
+			upload_session session;
+			session.size = size;
+			session.chunk_size = options_.chunk_size;
+			session.name = name;
+			auto id = unique_id(name);
+
+			rocksdb::WriteBatch batch;
+			batch.Put(uploads_handle_, id, session.encode());
+			write(batch);
+			return id;
+		}
+
+		// false if data does not match crc32, the chunk is then to be sent again;
+		// throws for an unknown upload or a chunk that is not where the session expects it
+		bool put_upload_chunk(std::string const& id, uint64_t offset, rocksdb::Slice const& data, uint32_t crc32)
+		{
+			if (detail::upload_crc32(data.data(), data.size()) != crc32)
+				return false;
+
+			// chunks of an upload go in parallel, only its completion or abort waits for them
+			std::shared_lock<std::shared_mutex> lock{ stripe(upload_mutexes_, id) };
+			upload_session session;
+			if (!get_upload(id, session))
+				throw std::runtime_error{ "Upload " + id + " not found." };
+			if (is_sealed(id))
+				throw std::runtime_error{ "Upload " + id + " is being completed." };
+			if (0 != offset % session.chunk_size || offset >= session.size ||
+				data.size() != std::min(session.chunk_size, session.size - offset))
+				throw std::runtime_error{ "Chunk at " + std::to_string(offset) + " does not fit upload " + id };
+
+			// the chunk and the mark that it arrived together
+			auto index = offset / session.chunk_size;
+			char crc_str[sizeof(uint32_t)];
+			encode_fixed_32(crc_str, crc32);
+			rocksdb::WriteBatch batch;
+			batch.Put(file_chunks_handle_, chunk_key(upload_key(id), index), data);
+			batch.Put(uploads_handle_, chunk_key(id, index), rocksdb::Slice{ crc_str, sizeof(crc_str) });
+			write(batch);
+			return true;
+		}
+
+		// false for an unknown upload, a completed one included
+		bool get_upload_status(std::string const& id, upload_status& status) const
+		{
+			upload_session session;
+			if (!get_upload(id, session))
+				return false;
+
+			status.name = session.name;
+			status.size = session.size;
+			status.chunk_size = session.chunk_size;
+			status.missing.clear();
+
+			auto chunks = session.chunks();
+			auto upper_key = chunk_key(id, chunks);
+			rocksdb::Slice upper_bound = upper_key;
+			rocksdb::ReadOptions op;
+			op.iterate_upper_bound = &upper_bound;
+			std::unique_ptr<rocksdb::Iterator> itr{ db_->NewIterator(op, uploads_handle_) };
+
+			uint64_t index = 0;
+			for (itr->Seek(chunk_key(id, 0)); itr->Valid(); itr->Next())
+			{
+				auto received = detail::decode_big_endian_64(itr->key().data() + id.size() + 1);
+				for (; index < received; ++index)
+					status.missing.push_back(index);
+				index = received + 1;
+			}
+			if (!itr->status().ok())
+				throw std::runtime_error{ itr->status().getState() };
+
+			for (; index < chunks; ++index)
+				status.missing.push_back(index);
+			return true;
+		}
+
+		// makes the upload the content of its name; throws if chunks are missing
+		void complete_upload(std::string const& id)
+		{
+			auto staged = upload_key(id);
+			upload_status status;
+			file_manifest manifest;
+			std::shared_ptr<rocksdb::Snapshot const> snapshot;
+			{
+				std::lock_guard<std::shared_mutex> lock{ stripe(upload_mutexes_, id) };
+				if (!get_upload_status(id, status))
+					throw std::runtime_error{ "Upload " + id + " not found." };
+				if (!status.missing.empty())
+					throw std::runtime_error{ "Upload " + id + " is missing " + std::to_string(status.missing.size()) + " chunks." };
+
+				manifest.size = status.size;
+				manifest.chunk_size = status.chunk_size;
+				if (!options_.deduplicate)
+				{
+					// the session goes with the commit, an abort after it must not take the chunks;
+					// the name switches to the staged chunks in place, nothing is copied
+					rocksdb::WriteBatch batch;
+					drop_upload(batch, id);
+					commit_file(status.name, staged, std::string{}, manifest, std::string{}, std::move(batch));
+					invalidate(status.name);
+					return;
+				}
+
+				// sealed, no chunk of the staged object changes while it is hashed
+				rocksdb::WriteBatch batch;
+				batch.Put(uploads_handle_, sealed_key(id), rocksdb::Slice{});
+				commit_file(staged, staged, std::string{}, manifest, std::string{}, std::move(batch));
+				snapshot = take_snapshot();
+			}
+
+			// hashed without the lock, the session keeps the staged object abort_upload's until it is linked
+			boost::uuids::detail::sha1 sha1;
+			rocksdb::ReadOptions op;
+			op.snapshot = snapshot.get();
+			read_object(op, staged, 0, manifest.size, [&sha1](rocksdb::Slice const& chunk)
+			{
+				sha1.process_bytes(chunk.data(), chunk.size());
+				return true;
+			});
+			snapshot.reset();
+
+			std::lock_guard<std::shared_mutex> lock{ stripe(upload_mutexes_, id) };
+			upload_session session;
+			if (!get_upload(id, session))
+				throw std::runtime_error{ "Upload " + id + " not found." };
+
+			// the session goes with the link: the staged object becomes the content, or is dropped if
+			// the content is stored already
+			rocksdb::WriteBatch batch;
+			drop_upload(batch, id);
+			link(status.name, detail::sha1_digest(sha1), staged, nullptr, std::string{}, std::move(batch));
+			invalidate(status.name);
+		}
+
+		void abort_upload(std::string const& id)
+		{
+			// a completed upload is gone, its chunks belong to its name now
+			std::lock_guard<std::shared_mutex> lock{ stripe(upload_mutexes_, id) };
+			upload_session session;
+			if (!get_upload(id, session))
+				return;
+
+			// a sealed upload has a manifest as well
+			auto staged = upload_key(id);
+			rocksdb::WriteBatch batch;
+			drop_staged(batch, staged);
+			batch.Delete(file_meta_handle_, staged);
+			drop_upload(batch, id);
+			write(batch);
+		}
+
+		// false if key is not a chunked file
+		bool stat(std::string const& key, file_manifest& manifest) const
+		{
+			auto object = key;
+			if (options_.deduplicate && !resolve(key, object))
+				return false;
+			return stat(rocksdb::ReadOptions{}, object, manifest);
+		}
+
+		// visitor(slice) -> bool gets [offset, offset + length) of a file in order, one slice per chunk,
+		// false stops the read; returns the bytes delivered, throws if there is no such file
+		template <typename Visitor>
+		uint64_t read(std::string const& key, uint64_t offset, uint64_t length, Visitor&& visitor) const
+		{
+			auto object = key;
+			if (options_.deduplicate && !resolve(key, object))
+				throw std::runtime_error{ "File " + key + " not found." };
+			return read_object(rocksdb::ReadOptions{}, object, offset, length, std::forward<Visitor>(visitor));
+		}
+
+		uint64_t read(std::string const& key, uint64_t offset, uint64_t length, std::string& value) const
+		{
+			return read(key, offset, length, [&value](rocksdb::Slice const& chunk)
+			{
+				value.append(chunk.data(), chunk.size());
+				return true;
+			});
+		}
+
+		// compact every column family, with blob garbage collection on it relocates live blobs too
+		void compact()
+		{
+			for (auto handle : handles_)
+			{
+				auto s = db_->CompactRange(rocksdb::CompactRangeOptions{}, handle, nullptr, nullptr);
+				if (!s.ok())
+					throw std::runtime_error{ s.getState() };
+			}
+		}
+
+		// with deduplication the content goes with its last name
+		void remove(std::string const& key)
+		{
+			if (!options_.deduplicate)
+			{
+				remove_object(key);
+				invalidate(key);
+				return;
+			}
+
+			std::lock_guard<std::mutex> name_lock{ stripe(name_mutexes_, key) };
+			std::string hash;
+			if (!get_name(key, hash))
+				return;
+
+			rocksdb::WriteBatch batch;
+			batch.Delete(file_names_handle_, key);
+			write(batch);
+			invalidate(key);
+			unref(hash);
+		}
+
 		std::string generator_file_name(std::string const& major_name, std::string const& timestamp) const
 		{
 			// input file generation params
@@ -69,38 +866,638 @@ namespace timax
 			file_name = gen_(ss.str());
 
 			// add ext
-			auto pos = major_name.rfind('.');
-			if (std::string::npos != pos)
-			{
-				file_name += major_name.substr(pos);
-			}	
+			file_name += file_extension(major_name);
 
 			return file_name;
 		}
 
 	private:
+		std::string load(std::string const& key, std::string& encoding)
+		{
+			auto object = key;
+			if (options_.deduplicate && !resolve(key, object))
+				throw std::runtime_error{ "File " + key + " not found." };
+
+			// the encoding and the payload from one snapshot
+			auto snapshot = take_snapshot();
+			rocksdb::ReadOptions op;
+			op.snapshot = snapshot.get();
+			encoding = encoding_of(op, object);
+			std::string value;
+			auto s = db_->Get(op, object, &value);
+			if (s.IsNotFound())
+			{
+				file_manifest manifest;
+				if (stat(op, object, manifest))
+				{
+					value.reserve(manifest.size);
+					read_object(op, object, 0, std::numeric_limits<uint64_t>::max(), [&value](rocksdb::Slice const& chunk)
+					{
+						value.append(chunk.data(), chunk.size());
+						return true;
+					});
+					return value;
+				}
+			}
+
+			if (!s.ok())
+				throw std::runtime_error{ s.getState() };
+			return value;
+		}
+
+		// through the cache, which only keeps payloads without an encoding
+		std::shared_ptr<std::string const> fetch(std::string const& key, std::string& encoding)
+		{
+			encoding.clear();
+			if (auto value = cache_->find(key))
+				return value;
+
+			auto version = cache_->version(key);
+			auto value = std::make_shared<std::string const>(load(key, encoding));
+			if (encoding.empty() && value->size() <= options_.cache_max_value_size)
+				cache_->insert(key, value, version);
+			return value;
+		}
+
+		void check_encoding(std::string const& encoding) const
+		{
+			if (!encoding.empty() && !options_.content_encoding)
+				throw std::runtime_error{ "Content encoding is not enabled." };
+			if (!encoding_supported(encoding))
+				throw std::runtime_error{ "Content encoding " + encoding + " is not supported." };
+		}
+
+		// an encoded stream is checked as it is written, close() refuses one that does not decode
+		file_writer with_encoding(file_writer&& writer, std::string const& encoding) const
+		{
+			writer.encoding_ = encoding;
+			if (!encoding.empty())
+				writer.validator_ = std::make_unique<content_validator>(encoding, options_.max_decoded_size);
+			return std::move(writer);
+		}
+
+		std::string encoding_of(rocksdb::ReadOptions const& op, std::string const& object) const
+		{
+			std::string encoding;
+			if (!options_.content_encoding)
+				return encoding;
+
+			auto s = db_->Get(op, file_encodings_handle_, object, &encoding);
+			if (!s.ok() && !s.IsNotFound())
+				throw std::runtime_error{ s.getState() };
+			return encoding;
+		}
+
+		// the encoding of an object goes in the batch that writes or removes it
+		void put_encoding(rocksdb::WriteBatch& batch, std::string const& object, std::string const& encoding)
+		{
+			if (!options_.content_encoding)
+				return;
+
+			if (encoding.empty())
+				batch.Delete(file_encodings_handle_, object);
+			else
+				batch.Put(file_encodings_handle_, object, encoding);
+		}
+
+		// released with its last copy
+		std::shared_ptr<rocksdb::Snapshot const> take_snapshot() const
+		{
+			auto db = db_.get();
+			return { db->GetSnapshot(), [db](rocksdb::Snapshot const* s) { db->ReleaseSnapshot(s); } };
+		}
+
+		// after the write, so a load racing with it drops its stale value
+		void invalidate(std::string const& key)
+		{
+			if (cache_)
+				cache_->erase(key);
+		}
+
+		// [offset, offset + length) of a chunked or a plain object, manifest and chunks from one snapshot
+		template <typename Visitor>
+		uint64_t read_object(rocksdb::ReadOptions op, std::string const& key, uint64_t offset, uint64_t length,
+			Visitor&& visitor) const
+		{
+			auto db = db_.get();
+			std::shared_ptr<rocksdb::Snapshot const> snapshot;
+			if (nullptr == op.snapshot)
+			{
+				snapshot = take_snapshot();
+				op.snapshot = snapshot.get();
+			}
+
+			file_manifest manifest;
+			if (!stat(op, key, manifest))
+			{
+				rocksdb::PinnableSlice value;
+				auto s = db->Get(op, db->DefaultColumnFamily(), key, &value);
+				if (!s.ok())
+					throw std::runtime_error{ s.IsNotFound() ? "File " + key + " not found." : std::string{ s.getState() } };
+
+				auto skip = std::min<uint64_t>(offset, value.size());
+				auto take = std::min<uint64_t>(length, value.size() - skip);
+				if (take > 0)
+					visitor(rocksdb::Slice{ value.data() + skip, static_cast<size_t>(take) });
+				return take;
+			}
+
+			auto end = offset + std::min(length, manifest.size - std::min(offset, manifest.size));
+			if (offset >= end)
+				return 0;
+
+			auto const& object = chunks_of(key, manifest);
+			auto first = offset / manifest.chunk_size;
+			auto last = (end - 1) / manifest.chunk_size;
+			auto upper_key = chunk_key(object, last + 1);
+			rocksdb::Slice upper_bound = upper_key;
+			op.iterate_upper_bound = &upper_bound;
+			op.readahead_size = 2 * manifest.chunk_size;
+			std::unique_ptr<rocksdb::Iterator> itr{ db->NewIterator(op, file_chunks_handle_) };
+
+			uint64_t delivered = 0;
+			auto index = first;
+			bool stopped = false;
+			for (itr->Seek(chunk_key(object, first)); itr->Valid() && !stopped; itr->Next(), ++index)
+			{
+				if (itr->key() != chunk_key(object, index))
+					break;
+
+				// clip the chunk to the range
+				auto chunk = itr->value();
+				auto position = index * manifest.chunk_size;
+				auto skip = std::min<uint64_t>(offset > position ? offset - position : 0, chunk.size());
+				auto take = std::min<uint64_t>(chunk.size() - skip, end - position - skip);
+				delivered += take;
+				stopped = !visitor(rocksdb::Slice{ chunk.data() + skip, static_cast<size_t>(take) });
+			}
+
+			if (!itr->status().ok())
+				throw std::runtime_error{ itr->status().getState() };
+			if (!stopped && index <= last)
+				throw std::runtime_error{ "File " + key + " is missing chunks." };
+			return delivered;
+		}
+
+		void put_object(std::string const& key, std::string const& value, std::string const& encoding = std::string{})
+		{
+			if (value.size() > options_.chunk_size)
+			{
+				file_writer writer{ *this, key, staging_key(key), options_.chunk_size };
+				writer.encoding_ = encoding;
+				writer.write(value);
+				writer.close();
+				return;
+			}
+
+			std::lock_guard<std::mutex> lock{ stripe(object_mutexes_, key) };
+			rocksdb::WriteBatch batch;
+			batch.Put(key, value);
+			batch.Delete(file_meta_handle_, key);
+			drop_chunks(batch, key);
+			put_encoding(batch, key, encoding);
+			write(batch);
+		}
+
+		// the chunks of an object that was staged but never committed
+		void remove_staged(std::string const& staged)
+		{
+			rocksdb::WriteBatch batch;
+			drop_staged(batch, staged);
+			write(batch);
+		}
+
+		void remove_object(std::string const& key)
+		{
+			std::lock_guard<std::mutex> lock{ stripe(object_mutexes_, key) };
+			rocksdb::WriteBatch batch;
+			drop_object(batch, key);
+			write(batch);
+		}
+
+		void drop_object(rocksdb::WriteBatch& batch, std::string const& key)
+		{
+			batch.Delete(key);
+			batch.Delete(file_meta_handle_, key);
+			drop_chunks(batch, key);
+			put_encoding(batch, key, std::string{});
+		}
+
+		// the chunks the manifest of key points at, if it has one, but for those under keep
+		void drop_chunks(rocksdb::WriteBatch& batch, std::string const& key, std::string const& keep = std::string{}) const
+		{
+			file_manifest manifest;
+			if (!stat(rocksdb::ReadOptions{}, key, manifest))
+				return;
+
+			auto const& object = chunks_of(key, manifest);
+			if (object != keep)
+				drop_staged(batch, object);
+		}
+
+		// objects holding chunks are upload:<uuid>, all of a length, so the range takes no other's chunks
+		void drop_staged(rocksdb::WriteBatch& batch, std::string const& object) const
+		{
+			batch.DeleteRange(file_chunks_handle_, chunk_key(object, 0),
+				chunk_key(object, std::numeric_limits<uint64_t>::max()));
+		}
+
+		static std::string const& chunks_of(std::string const& key, file_manifest const& manifest)
+		{
+			return manifest.object.empty() ? key : manifest.object;
+		}
+
+		template <typename Mutex>
+		static Mutex& stripe(Mutex (&mutexes)[lock_stripes], std::string const& key)
+		{
+			return mutexes[std::hash<std::string>{}(key) % lock_stripes];
+		}
+
+		static std::string upload_key(std::string const& id)
+		{
+			return "upload:" + id;
+		}
+
+		// an id no other call hands out, seeded with key
+		std::string unique_id(std::string const& key) const
+		{
+			std::stringstream ss;
+			ss << key << std::chrono::steady_clock::now().time_since_epoch().count() << std::this_thread::get_id();
+			return gen_(ss.str());
+		}
+
+		// where a file_writer of key stages its chunks until they are committed
+		std::string staging_key(std::string const& key) const
+		{
+			return upload_key(unique_id(key));
+		}
+
+		bool get_upload(std::string const& id, upload_session& session) const
+		{
+			std::string value;
+			auto s = db_->Get(rocksdb::ReadOptions{}, uploads_handle_, id, &value);
+			if (s.IsNotFound())
+				return false;
+			if (!s.ok())
+				throw std::runtime_error{ s.getState() };
+			if (!upload_session::decode(value, session))
+				throw std::runtime_error{ "Corrupted upload session " + id };
+			return true;
+		}
+
+		// set while complete_upload hashes the staged object; ids are uuids, nothing else ends in '!'
+		static std::string sealed_key(std::string const& id)
+		{
+			return id + '!';
+		}
+
+		bool is_sealed(std::string const& id) const
+		{
+			std::string value;
+			auto s = db_->Get(rocksdb::ReadOptions{}, uploads_handle_, sealed_key(id), &value);
+			if (s.IsNotFound())
+				return false;
+			if (!s.ok())
+				throw std::runtime_error{ s.getState() };
+			return true;
+		}
+
+		void drop_upload(rocksdb::WriteBatch& batch, std::string const& id)
+		{
+			batch.Delete(uploads_handle_, id);
+			batch.Delete(uploads_handle_, sealed_key(id));
+			batch.DeleteRange(uploads_handle_, chunk_key(id, 0), chunk_key(id, std::numeric_limits<uint64_t>::max()));
+		}
+
+		// sha1:<hex digest>
+		static std::string object_key(std::string const& hash)
+		{
+			static char const digits[] = "0123456789abcdef";
+			std::string key = "sha1:";
+			for (unsigned char c : hash)
+			{
+				key.push_back(digits[c >> 4]);
+				key.push_back(digits[c & 0xf]);
+			}
+			return key;
+		}
+
+		bool get_name(std::string const& name, std::string& hash) const
+		{
+			auto s = db_->Get(rocksdb::ReadOptions{}, file_names_handle_, name, &hash);
+			if (s.IsNotFound())
+				return false;
+			if (!s.ok())
+				throw std::runtime_error{ s.getState() };
+			return true;
+		}
+
+		bool get_content(std::string const& hash, content_record& record) const
+		{
+			std::string value;
+			auto s = db_->Get(rocksdb::ReadOptions{}, file_content_handle_, hash, &value);
+			if (s.IsNotFound())
+				return false;
+			if (!s.ok())
+				throw std::runtime_error{ s.getState() };
+			if (!content_record::decode(value, record))
+				throw std::runtime_error{ "Corrupted content record of " + object_key(hash) };
+			return true;
+		}
+
+		// the object holding the content of name
+		bool resolve(std::string const& name, std::string& object) const
+		{
+			std::string hash;
+			content_record record;
+			if (!get_name(name, hash) || !get_content(hash, record))
+				return false;
+
+			object = std::move(record.object);
+			return true;
+		}
+
+		// point name at hash; new content is value, or the committed object staged by a file_writer,
+		// which is dropped when the content is stored already
+		// batch goes with the name, staged is an object no other call writes to
+		void link(std::string const& name, std::string const& hash, std::string const& staged, std::string const* value,
+			std::string const& encoding = std::string{}, rocksdb::WriteBatch batch = rocksdb::WriteBatch{})
+		{
+			std::lock_guard<std::mutex> name_lock{ stripe(name_mutexes_, name) };
+			std::string old_hash;
+			auto renamed = get_name(name, old_hash) && old_hash != hash;
+			auto relinked = !renamed && !old_hash.empty();
+			{
+				std::lock_guard<std::mutex> content_lock{ stripe(content_mutexes_, hash) };
+				content_record record;
+				auto stored = get_content(hash, record);
+				if (!stored)
+				{
+					record.object = staged.empty() ? object_key(hash) : staged;
+					if (value)
+						put_object(record.object, *value, encoding);
+				}
+
+				if (!relinked || !stored)
+				{
+					++record.refs;
+					batch.Put(file_content_handle_, hash, record.encode());
+					batch.Put(file_names_handle_, name, hash);
+				}
+
+				// a staged copy of content stored already goes in the same write
+				if (stored && !staged.empty() && staged != record.object)
+					drop_object(batch, staged);
+				if (batch.Count() > 0)
+					write(batch);
+			}
+
+			if (renamed)
+				unref(old_hash);
+		}
+
+		void unref(std::string const& hash)
+		{
+			std::lock_guard<std::mutex> content_lock{ stripe(content_mutexes_, hash) };
+			content_record record;
+			if (!get_content(hash, record))
+				return;
+
+			rocksdb::WriteBatch batch;
+			if (--record.refs > 0)
+			{
+				batch.Put(file_content_handle_, hash, record.encode());
+				write(batch);
+				return;
+			}
+
+			// the record goes first, a crash leaves an unreferenced object rather than a dangling name
+			batch.Delete(file_content_handle_, hash);
+			write(batch);
+			remove_object(record.object);
+		}
+
+		// <key>/<big endian chunk#>, the chunks of a file sort in order
+		static std::string chunk_key(std::string const& key, uint64_t index)
+		{
+			std::string chunk;
+			chunk.reserve(key.size() + 1 + sizeof(uint64_t));
+			chunk.append(key).push_back('/');
+			char index_str[sizeof(uint64_t)];
+			detail::encode_big_endian_64(index_str, index);
+			chunk.append(index_str, sizeof(index_str));
+			return chunk;
+		}
+
+		bool stat(rocksdb::ReadOptions const& op, std::string const& key, file_manifest& manifest) const
+		{
+			std::string value;
+			auto s = db_->Get(op, file_meta_handle_, key, &value);
+			if (s.IsNotFound())
+				return false;
+			if (!s.ok())
+				throw std::runtime_error{ s.getState() };
+			if (!file_manifest::decode(value, manifest))
+				throw std::runtime_error{ "Corrupted manifest of " + key };
+			return true;
+		}
+
+		void write(rocksdb::WriteBatch& batch)
+		{
+			auto s = db_->Write(rocksdb::WriteOptions{}, &batch);
+			if (!s.ok())
+				throw std::runtime_error{ s.getState() };
+		}
+
+		void put_chunk(std::string const& key, uint64_t index, rocksdb::Slice const& chunk)
+		{
+			auto s = db_->Put(rocksdb::WriteOptions{}, file_chunks_handle_, chunk_key(key, index), chunk);
+			if (!s.ok())
+				throw std::runtime_error{ s.getState() };
+		}
+
+		// the last chunk, a manifest of key pointing at the chunks staged under staged and the removal
+		// of the chunks key had in one batch with what batch holds, readers get the old file or the new one
+		void commit_file(std::string const& key, std::string const& staged, std::string const& last_chunk,
+			file_manifest manifest, std::string const& encoding = std::string{}, rocksdb::WriteBatch batch = rocksdb::WriteBatch{})
+		{
+			std::lock_guard<std::mutex> lock{ stripe(object_mutexes_, key) };
+			drop_chunks(batch, key, staged);
+			if (!last_chunk.empty())
+				batch.Put(file_chunks_handle_, chunk_key(staged, manifest.chunks() - 1), last_chunk);
+			manifest.object = staged == key ? std::string{} : staged;
+			batch.Put(file_meta_handle_, key, manifest.encode());
+			batch.Delete(key);
+			put_encoding(batch, key, encoding);
+			write(batch);
+		}
+
+		void enable_blob_files(rocksdb::ColumnFamilyOptions& op) const
+		{
+#if ROCKSDB_MAJOR > 6 || (ROCKSDB_MAJOR == 6 && ROCKSDB_MINOR >= 20)
+			auto const& blob = options_.blob;
+			op.enable_blob_files = true;
+			op.min_blob_size = blob.min_blob_size;
+			op.blob_file_size = blob.blob_file_size;
+			op.blob_compression_type = blob.compression ? rocksdb::kLZ4Compression : rocksdb::kNoCompression;
+			op.enable_blob_garbage_collection = blob.garbage_collection;
+			op.blob_garbage_collection_age_cutoff = blob.garbage_collection_age_cutoff;
+			op.blob_garbage_collection_force_threshold = blob.garbage_collection_force_threshold;
+#else
+			(void)op;
+			throw std::runtime_error{ "Blob files need rocksdb 6.20 or later." };
+#endif
+		}
+
 		void init(std::string const& path)
 		{
-			rocksdb::Status s;
+			using namespace rocksdb;
+			Status s;
 
-			rocksdb::Options op;
+			Options op;
 			op.IncreaseParallelism(std::thread::hardware_concurrency());
 			op.OptimizeLevelStyleCompaction();
 			op.create_if_missing = true;
+			op.create_missing_column_families = true;
 			op.compression_per_level.resize(2);
+			op.statistics = options_.statistics;
+
+			ColumnFamilyOptions payload_op{ op };
+			if (options_.blob.enabled)
+				enable_blob_files(payload_op);
 
-			rocksdb::DB* db_raw = nullptr;
-			s = rocksdb::DB::Open(op, path, &db_raw);
-			if (rocksdb::Status::OK() != s)
+			// small files in the default column family, chunks, manifests, the name -> content
+			// hash -> object maps of deduplication, the sessions of resumable uploads and the
+			// content encodings of objects in their own; chunks never share a key space with names
+			std::vector<ColumnFamilyDescriptor> column_families;
+			column_families.push_back(ColumnFamilyDescriptor(kDefaultColumnFamilyName, payload_op));
+			column_families.push_back(ColumnFamilyDescriptor(file_meta_column_family_name_, ColumnFamilyOptions{}));
+			column_families.push_back(ColumnFamilyDescriptor(file_names_column_family_name_, ColumnFamilyOptions{}));
+			column_families.push_back(ColumnFamilyDescriptor(file_content_column_family_name_, ColumnFamilyOptions{}));
+			column_families.push_back(ColumnFamilyDescriptor(file_uploads_column_family_name_, ColumnFamilyOptions{}));
+			column_families.push_back(ColumnFamilyDescriptor(file_encodings_column_family_name_, ColumnFamilyOptions{}));
+			column_families.push_back(ColumnFamilyDescriptor(file_chunks_column_family_name_, payload_op));
+			std::vector<ColumnFamilyHandle*> raw_handles;
+
+			DB* db_raw = nullptr;
+			s = DB::Open(op, path, column_families, &raw_handles, &db_raw);
+			if (Status::OK() != s)
 			{
 				throw std::runtime_error{ s.getState() };
 			}
 
 			db_.reset(db_raw);
+			file_meta_handle_ = raw_handles[1];
+			file_names_handle_ = raw_handles[2];
+			file_content_handle_ = raw_handles[3];
+			uploads_handle_ = raw_handles[4];
+			file_encodings_handle_ = raw_handles[5];
+			file_chunks_handle_ = raw_handles[6];
+			handles_ = std::move(raw_handles);
 		}
 
 	private:
+		file_store_options const			options_;
 		std::unique_ptr<rocksdb::DB>		db_;
 		file_name_generator				gen_;
+		std::string const				file_meta_column_family_name_ = "file_meta";
+		std::string const				file_names_column_family_name_ = "file_names";
+		std::string const				file_content_column_family_name_ = "file_content";
+		std::string const				file_uploads_column_family_name_ = "file_uploads";
+		std::string const				file_encodings_column_family_name_ = "file_encodings";
+		std::string const				file_chunks_column_family_name_ = "file_chunks";
+		column_family_handles_t			handles_;
+		rocksdb::ColumnFamilyHandle*		file_meta_handle_ = nullptr;
+		rocksdb::ColumnFamilyHandle*		file_names_handle_ = nullptr;
+		rocksdb::ColumnFamilyHandle*		file_content_handle_ = nullptr;
+		rocksdb::ColumnFamilyHandle*		uploads_handle_ = nullptr;
+		rocksdb::ColumnFamilyHandle*		file_encodings_handle_ = nullptr;
+		rocksdb::ColumnFamilyHandle*		file_chunks_handle_ = nullptr;
+
+		// deduplication, names before contents, one content at a time
+		std::mutex						name_mutexes_[lock_stripes];
+		std::mutex						content_mutexes_[lock_stripes];
+
+		// completion of an upload excludes chunks still arriving for it
+		std::shared_mutex				upload_mutexes_[lock_stripes];
+
+		// one commit or removal of an object at a time, taken after the locks above
+		std::mutex						object_mutexes_[lock_stripes];
+
+		std::unique_ptr<lru_cache>		cache_;
 	};
+
+	inline file_writer::~file_writer()
+	{
+		if (nullptr == store_)
+			return;
+
+		// never closed, drop what was staged and the cached entry like close() does
+		try
+		{
+			store_->remove_staged(staged_);
+			store_->invalidate(name_.empty() ? key_ : name_);
+		}
+		catch (...)
+		{
+		}
+	}
+
+	inline void file_writer::write(char const* data, size_t size)
+	{
+		if (validator_)
+			validator_->update(data, size);
+		if (!name_.empty())
+			sha1_.process_bytes(data, size);
+
+		size_ += size;
+		while (size > 0)
+		{
+			// whole chunks straight from the caller, the rest through the buffer
+			if (buffer_.empty() && size >= chunk_size_)
+			{
+				store_->put_chunk(staged_, chunks_++, rocksdb::Slice{ data, chunk_size_ });
+				data += chunk_size_;
+				size -= chunk_size_;
+				continue;
+			}
+
+			auto count = std::min(size, chunk_size_ - buffer_.size());
+			buffer_.append(data, count);
+			data += count;
+			size -= count;
+			if (buffer_.size() == chunk_size_)
+			{
+				store_->put_chunk(staged_, chunks_++, buffer_);
+				buffer_.clear();
+			}
+		}
+	}
+
+	inline void file_writer::close()
+	{
+		if (validator_)
+			validator_->finish();
+
+		file_manifest manifest;
+		manifest.size = size_;
+		manifest.chunk_size = chunk_size_;
+		store_->commit_file(key_, staged_, buffer_, manifest, encoding_);
+
+		// a failed link leaves the staged object unreferenced rather than risk removing a referenced one
+		auto store = std::exchange(store_, nullptr);
+		if (!name_.empty())
+		{
+			try
+			{
+				store->link(name_, detail::sha1_digest(sha1_), key_, nullptr);
+			}
+			catch (...)
+			{
+				store->invalidate(name_);
+				throw;
+			}
+		}
+		store->invalidate(name_.empty() ? key_ : name_);
+	}
 }
\ No newline at end of file
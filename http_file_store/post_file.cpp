@@ -1,48 +1,362 @@
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <memory>
-#include <curl\curl.h>
+#include <vector>
+#include <deque>
+#include <chrono>
+#include <tuple>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <filesystem>
+#include <curl/curl.h>
+#include <boost/crc.hpp>
+#include "content_encoding.hpp"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 static char const post_file_buf[] = "Expect:";
 static char const post_file_file_name[] = "file_name: ";
+static char const post_file_chunked[] = "Transfer-Encoding: chunked";
+static char const post_file_content_encoding[] = "Content-Encoding: ";
+static char const post_file_encoding_flag[] = "--encoding=";
+static char const post_file_verbose_flag[] = "--verbose";
+static char const post_file_bulk_flag[] = "--bulk";
+static char const post_file_resume_flag[] = "--resume";
+static char const post_file_stdin[] = "-";
+
+// resumable uploads, every request is a POST to the same url:
+//   upload: begin, file_name, file_size					-> "<upload id> <chunk size>"
+//   upload: status, upload_id							-> "<chunk size> <missing chunk#>...", 404 once unknown
+//   upload: chunk, upload_id, upload_offset, upload_crc32	with the chunk as body, 4xx if it does not check out
+//   upload: complete, upload_id
+// the upload id is kept in <file-name>.upload until the upload completes, so a rerun resumes it
+static char const post_file_upload[] = "upload: ";
+static char const post_file_upload_id[] = "upload_id: ";
+static char const post_file_upload_offset[] = "upload_offset: ";
+static char const post_file_upload_crc32[] = "upload_crc32: ";
+static char const post_file_file_size[] = "file_size: ";
+static char const post_file_upload_state[] = ".upload";
 
+// [--encoding=zstd|lz4] in front of any of the commands below compresses what is sent, except media
+// that are compressed already and the chunks of resumable uploads
+int const post_file_zstd_level = 3;
+int const post_file_lz4_level = 0;
+size_t const post_file_stream_buffer_size = 64 << 10;
+
+// ./post_file.exe url file-name, or ./post_file.exe url - file-name to stream stdin;
+// [--verbose] in front traces the request
 size_t const post_file_argc_size = 3;
+size_t const post_file_stdin_argc_size = 4;
 size_t const post_file_name_index = 2;
 size_t const post_file_url_index = 1;
+size_t const post_file_stdin_name_index = 3;
+
+// ./post_file.exe --bulk url dir-or-manifest [concurrency]
+size_t const post_file_bulk_url_index = 2;
+size_t const post_file_bulk_source_index = 3;
+size_t const post_file_bulk_concurrency_index = 4;
+long const post_file_bulk_default_concurrency = 16;
+
+// ./post_file.exe --resume url file-name [concurrency]
+size_t const post_file_resume_url_index = 2;
+size_t const post_file_resume_name_index = 3;
+size_t const post_file_resume_concurrency_index = 4;
+long const post_file_resume_default_concurrency = 4;
+size_t const post_file_resume_attempts = 3;			// per chunk and run
+
+/* read only view of a whole file, pages are loaded as curl sends them */
+class mapped_file
+{
+public:
+	mapped_file() = default;
+	mapped_file(mapped_file const&) = delete;
+	mapped_file& operator= (mapped_file const&) = delete;
+
+	~mapped_file()
+	{
+		close();
+	}
+
+	bool open(std::string const& file_name);
+	void close();
+
+	// drops the pages of [begin, end) from memory, they are read again if touched
+	void release(size_t begin, size_t end);
+
+	char const* data() const noexcept
+	{
+		return data_;
+	}
+
+	size_t size() const noexcept
+	{
+		return size_;
+	}
+
+private:
+	char const*		data_ = nullptr;
+	size_t			size_ = 0;
+};
+
+/* request body sent through CURLOPT_READFUNCTION, a mapped file of known size or a stream sent chunked;
+   with an encoding it is compressed on the way and always sent chunked */
+struct upload_body
+{
+	mapped_file		file;
+	FILE*			stream = nullptr;
+	size_t			offset = 0;
+	std::string		encoding;
+
+	std::unique_ptr<timax::content_encoder>	encoder;
+	std::string		input;					// read from stream, not compressed yet
+	size_t			input_offset = 0;
+	bool			eof = false;
+};
+
+// sent pages of a mapped body are released every this many bytes
+size_t const post_file_release_size = 8 << 20;
 
 std::string post_file(
-	std::string const& url, 
-	std::string const& file_name, 
-	std::string const& content);
+	std::string const& url,
+	std::string const& file_name,
+	upload_body& body,
+	bool verbose);
+
+int post_files(
+	std::string const& url,
+	std::string const& source,
+	long concurrency,
+	std::string const& encoding);
 
-long recv_func(void* ptr, int size, int nmemb, void* data);
+int post_file_resumable(
+	std::string const& url,
+	std::string const& file_name,
+	long concurrency);
+
+size_t recv_func(char* ptr, size_t size, size_t nmemb, void* data);
+size_t send_func(char* ptr, size_t size, size_t nmemb, void* data);
+int seek_func(void* data, curl_off_t offset, int origin);
 
 int main(int argc, char* argv[])
 {
-	if (post_file_argc_size != argc)
-		std::cout << "USAGE: ./post_file.exe url file-name" << std::endl;
+	std::string encoding;
+	bool verbose = false;
+	for (; argc > 1; ++argv, --argc)
+	{
+		if (std::string{ post_file_verbose_flag } == argv[1])
+		{
+			verbose = true;
+		}
+		else if (0 == std::strncmp(argv[1], post_file_encoding_flag, sizeof(post_file_encoding_flag) - 1))
+		{
+			encoding = argv[1] + sizeof(post_file_encoding_flag) - 1;
+			if (!timax::encoding_supported(encoding))
+			{
+				std::cout << "Encoding: " << encoding << " not supported!" << std::endl;
+				return 1;
+			}
+		}
+		else
+		{
+			break;
+		}
+	}
 
-	std::string url = argv[post_file_url_index];
-	std::string file_name = argv[post_file_name_index];
+	if (argc > 1 && std::string{ post_file_bulk_flag } == argv[1])
+	{
+		if (static_cast<int>(post_file_bulk_source_index) >= argc)
+		{
+			std::cout << "USAGE: ./post_file.exe --bulk url dir-or-manifest [concurrency]" << std::endl;
+			return 1;
+		}
 
-	std::ifstream file_stream;
-	file_stream.open(file_name);
-	if (!file_stream)
-		std::cout << "File: " << file_name << " not exists!" << std::endl;
+		auto concurrency = static_cast<int>(post_file_bulk_concurrency_index) < argc ?
+			std::stol(argv[post_file_bulk_concurrency_index]) : post_file_bulk_default_concurrency;
 
-	std::string file_content;
-	file_stream.seekg(0, std::ios::end);
-	size_t size = file_stream.tellg();
-	file_content.resize(size);
-	file_stream.seekg(std::ios::beg);
-	file_stream.read(&file_content[0], size);
-	file_stream.close();
+		curl_global_init(CURL_GLOBAL_ALL);
+		auto result = post_files(argv[post_file_bulk_url_index], argv[post_file_bulk_source_index], std::max(concurrency, 1L), encoding);
+		curl_global_cleanup();
+		return result;
+	}
+
+	if (argc > 1 && std::string{ post_file_resume_flag } == argv[1])
+	{
+		if (static_cast<int>(post_file_resume_name_index) >= argc)
+		{
+			std::cout << "USAGE: ./post_file.exe --resume url file-name [concurrency]" << std::endl;
+			return 1;
+		}
+
+		auto concurrency = static_cast<int>(post_file_resume_concurrency_index) < argc ?
+			std::stol(argv[post_file_resume_concurrency_index]) : post_file_resume_default_concurrency;
+
+		curl_global_init(CURL_GLOBAL_ALL);
+		auto result = post_file_resumable(argv[post_file_resume_url_index], argv[post_file_resume_name_index], std::max(concurrency, 1L));
+		curl_global_cleanup();
+		return result;
+	}
+
+	bool from_stdin = post_file_stdin_argc_size == argc && std::string{ post_file_stdin } == argv[post_file_name_index];
+	if (post_file_argc_size != argc && !from_stdin)
+	{
+		std::cout << "USAGE: ./post_file.exe [--verbose] [--encoding=zstd|lz4] url file-name" << std::endl;
+		std::cout << "       ./post_file.exe [--verbose] [--encoding=zstd|lz4] url - file-name" << std::endl;
+		std::cout << "       ./post_file.exe [--encoding=zstd|lz4] --bulk url dir-or-manifest [concurrency]" << std::endl;
+		std::cout << "       ./post_file.exe --resume url file-name [concurrency]" << std::endl;
+		return 1;
+	}
+
+	std::string url = argv[post_file_url_index];
+	upload_body body;
+	std::string file_name;
+	if (from_stdin)
+	{
+		file_name = argv[post_file_stdin_name_index];
+		body.stream = stdin;
+#ifdef _WIN32
+		_setmode(_fileno(stdin), _O_BINARY);
+#endif
+	}
+	else
+	{
+		file_name = argv[post_file_name_index];
+		if (!body.file.open(file_name))
+		{
+			std::cout << "File: " << file_name << " not exists!" << std::endl;
+			return 1;
+		}
+	}
 
-	std::cout << post_file(url, file_name, file_content) << std::endl;
+	if (!timax::is_compressed_media(file_name))
+		body.encoding = encoding;
+	std::cout << post_file(url, file_name, body, verbose) << std::endl;
 	return 0;
 }
 
+#ifdef _WIN32
+bool mapped_file::open(std::string const& file_name)
+{
+	close();
+	auto file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (INVALID_HANDLE_VALUE == file)
+		return false;
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	// an empty file cannot be mapped and needs no view
+	if (0 == size.QuadPart)
+	{
+		CloseHandle(file);
+		return true;
+	}
+
+	auto mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	CloseHandle(file);
+	if (nullptr == mapping)
+		return false;
+
+	// the view keeps the mapping alive
+	auto view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (nullptr == view)
+		return false;
+
+	data_ = static_cast<char const*>(view);
+	size_ = static_cast<size_t>(size.QuadPart);
+	return true;
+}
+
+void mapped_file::close()
+{
+	if (nullptr != data_)
+		UnmapViewOfFile(data_);
+	data_ = nullptr;
+	size_ = 0;
+}
+
+void mapped_file::release(size_t begin, size_t end)
+{
+	// clean pages of a read only view are trimmed from the working set without being written
+	end = std::min(end, size_);
+	if (nullptr == data_ || begin >= end)
+		return;
+
+	VirtualUnlock(const_cast<char*>(data_) + begin, end - begin);
+}
+#else
+bool mapped_file::open(std::string const& file_name)
+{
+	close();
+	auto fd = ::open(file_name.c_str(), O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat st;
+	if (0 != ::fstat(fd, &st) || !S_ISREG(st.st_mode))
+	{
+		::close(fd);
+		return false;
+	}
+
+	// an empty file cannot be mapped and needs no view
+	if (0 == st.st_size)
+	{
+		::close(fd);
+		return true;
+	}
+
+	// the mapping stays valid after the descriptor is closed
+	auto view = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (MAP_FAILED == view)
+		return false;
+
+	::madvise(view, static_cast<size_t>(st.st_size), MADV_SEQUENTIAL);
+	data_ = static_cast<char const*>(view);
+	size_ = static_cast<size_t>(st.st_size);
+	return true;
+}
+
+void mapped_file::close()
+{
+	if (nullptr != data_)
+		::munmap(const_cast<char*>(data_), size_);
+	data_ = nullptr;
+	size_ = 0;
+}
+
+void mapped_file::release(size_t begin, size_t end)
+{
+	// from the page begin is on, the mapping is private and never written so nothing is lost
+	static auto const page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+	begin -= begin % page_size;
+	end = std::min(end, size_);
+	if (nullptr == data_ || begin >= end)
+		return;
+
+	::madvise(const_cast<char*>(data_) + begin, end - begin, MADV_DONTNEED);
+}
+#endif
+
 struct curl_delete
 {
 	void operator() (CURL* curl)
@@ -61,12 +375,56 @@ struct curl_delete_slist
 	}
 };
 
+struct curl_delete_multi
+{
+	void operator() (CURLM* multi)
+	{
+		if (nullptr != multi)
+			curl_multi_cleanup(multi);
+	}
+};
+
+// POSTs the body without buffering it, a stream of unknown size goes out chunked
+curl_slist* set_upload_body(CURL* curl, curl_slist* headers, upload_body& body)
+{
+	body.offset = 0;
+	body.input.clear();
+	body.input_offset = 0;
+	body.eof = false;
+	body.encoder.reset();
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	curl_easy_setopt(curl, CURLOPT_READFUNCTION, send_func);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &body);
+
+	// the compressed size is not known up front
+	if (!body.encoding.empty())
+	{
+		auto level = timax::zstd_encoding == body.encoding ? post_file_zstd_level : post_file_lz4_level;
+		body.encoder = std::make_unique<timax::content_encoder>(body.encoding, level);
+		headers = curl_slist_append(headers, (post_file_content_encoding + body.encoding).c_str());
+	}
+
+	if (nullptr != body.stream || body.encoder)
+	{
+		curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, nullptr);
+		curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(-1));
+		return curl_slist_append(headers, post_file_chunked);
+	}
+
+	// a known size lets curl send Content-Length, seeking lets it resend after a redirect
+	curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seek_func);
+	curl_easy_setopt(curl, CURLOPT_SEEKDATA, &body);
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(body.file.size()));
+	return headers;
+}
+
 // 192.168.0.24/upload_file?file_name=1.gif
 
 std::string post_file(
-	std::string const& url, 
-	std::string const& file_name, 
-	std::string const& content)
+	std::string const& url,
+	std::string const& file_name,
+	upload_body& body,
+	bool verbose)
 {
 	std::unique_ptr<CURL, curl_delete> curl;
 	curl.reset(curl_easy_init());
@@ -76,12 +434,15 @@ std::string post_file(
 	// append headers
 	curl_slist* chunck = nullptr;
 	chunck = curl_slist_append(chunck, post_file_buf);
-	
+
 	// append file name
 	std::string file_name_header;
 	file_name_header = post_file_file_name + file_name;
 	chunck = curl_slist_append(chunck, file_name_header.c_str());
 
+	// file content
+	chunck = set_upload_body(curl.get(), chunck, body);
+
 	// raii
 	std::unique_ptr<curl_slist, curl_delete_slist> headerlist;
 	headerlist.reset(chunck);
@@ -91,9 +452,8 @@ std::string post_file(
 
 	// http options
 	curl_easy_setopt(curl.get(), CURLOPT_URL, url.c_str());				// url
-	curl_easy_setopt(curl.get(), CURLOPT_VERBOSE, 1L);					// trace
+	curl_easy_setopt(curl.get(), CURLOPT_VERBOSE, verbose ? 1L : 0L);		// trace
 	curl_easy_setopt(curl.get(), CURLOPT_HTTPHEADER, headerlist.get());	// append header
-	curl_easy_setopt(curl.get(), CURLOPT_POSTFIELDS, content.c_str());	// file content
 	curl_easy_setopt(curl.get(), CURLOPT_WRITEFUNCTION, recv_func);		// write function
 	curl_easy_setopt(curl.get(), CURLOPT_WRITEDATA, &response);			// write dest
 
@@ -105,10 +465,590 @@ std::string post_file(
 	return response;
 }
 
-long recv_func(void* ptr, int size, int nmemb, void* data)
+// at most concurrency connections, kept open for the next transfer
+CURLM* new_multi(long concurrency)
+{
+	auto multi = curl_multi_init();
+	if (nullptr != multi)
+	{
+		curl_multi_setopt(multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, concurrency);
+		curl_multi_setopt(multi, CURLMOPT_MAXCONNECTS, concurrency);
+	}
+	return multi;
+}
+
+// drives multi until no transfer is active, done(msg) sees every finished one, removes it and may start the next
+template <typename Done>
+void run_transfers(CURLM* multi, size_t const& active, Done&& done)
+{
+	while (active > 0)
+	{
+		int running = 0;
+		curl_multi_perform(multi, &running);
+
+		int queued = 0;
+		while (CURLMsg* msg = curl_multi_info_read(multi, &queued))
+		{
+			if (CURLMSG_DONE == msg->msg)
+				done(msg);
+		}
+
+		if (active > 0)
+			curl_multi_wait(multi, nullptr, 0, 1000, nullptr);
+	}
+}
+
+// one transfer at a time, the handle and its connection are reused by the next file
+struct bulk_slot
+{
+	std::unique_ptr<CURL, curl_delete>				curl;
+	std::unique_ptr<curl_slist, curl_delete_slist>	headers;
+	upload_body										body;
+	std::string										response;
+	size_t											result = 0;		// index into the results
+};
+
+struct bulk_result
+{
+	std::string										file_name;
+	size_t											bytes = 0;
+	curl_off_t										sent_bytes = 0;		// on the wire, compressed
+	long											status = 0;
+	double											seconds = 0;
+	std::string										error;
+};
+
+// every regular file under a directory named relative to it, or one path per line of a manifest
+std::vector<std::pair<std::string, std::string>> list_files(std::string const& source)
+{
+	namespace fs = std::filesystem;
+	std::vector<std::pair<std::string, std::string>> files;
+	if (fs::is_directory(source))
+	{
+		for (auto const& entry : fs::recursive_directory_iterator{ source })
+		{
+			if (entry.is_regular_file())
+				files.emplace_back(entry.path().string(), fs::relative(entry.path(), source).generic_string());
+		}
+		std::sort(files.begin(), files.end());
+		return files;
+	}
+
+	std::ifstream manifest{ source };
+	std::string line;
+	while (std::getline(manifest, line))
+	{
+		if (!line.empty() && '\r' == line.back())
+			line.pop_back();
+		if (!line.empty())
+			files.emplace_back(line, line);
+	}
+	return files;
+}
+
+bool start_transfer(
+	CURLM* multi,
+	bulk_slot& slot,
+	std::string const& url,
+	std::pair<std::string, std::string> const& file,
+	std::string const& encoding,
+	bulk_result& result)
 {
-	auto sizes = static_cast<long>(size * nmemb);
+	result.file_name = file.second;
+	if (!slot.body.file.open(file.first))
+	{
+		result.error = "File not exists!";
+		return false;
+	}
+	result.bytes = slot.body.file.size();
+	slot.body.encoding = timax::is_compressed_media(file.second) ? std::string{} : encoding;
+
+	if (!slot.curl)
+		slot.curl.reset(curl_easy_init());
+	if (!slot.curl)
+	{
+		result.error = "Failed to initialize curl!";
+		return false;
+	}
+
+	curl_slist* chunck = nullptr;
+	chunck = curl_slist_append(chunck, post_file_buf);
+	chunck = curl_slist_append(chunck, (post_file_file_name + file.second).c_str());
+	chunck = set_upload_body(slot.curl.get(), chunck, slot.body);
+	slot.headers.reset(chunck);
+	slot.response.clear();
+
+	auto curl = slot.curl.get();
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slot.headers.get());
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, recv_func);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &slot.response);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+	curl_easy_setopt(curl, CURLOPT_PRIVATE, &slot);
+
+	if (CURLM_OK != curl_multi_add_handle(multi, curl))
+	{
+		result.error = "Failed to start transfer!";
+		return false;
+	}
+	return true;
+}
+
+// uploads every file over at most concurrency kept-alive connections, prints a line per file and a summary
+int post_files(
+	std::string const& url,
+	std::string const& source,
+	long concurrency,
+	std::string const& encoding)
+{
+	auto files = list_files(source);
+
+	std::unique_ptr<CURLM, curl_delete_multi> multi;
+	multi.reset(new_multi(concurrency));
+	if (!multi)
+	{
+		std::cout << "Failed to initialize curl!" << std::endl;
+		return 1;
+	}
+
+	std::vector<bulk_slot> slots(static_cast<size_t>(concurrency));
+	std::vector<bulk_result> results(files.size());
+
+	auto print = [](bulk_result const& r)
+	{
+		std::cout << r.file_name << " bytes=" << r.bytes << " sent_bytes=" << r.sent_bytes << " status=" << r.status << " seconds=" << r.seconds
+			<< " mb_per_second=" << (r.seconds > 0 ? r.bytes / r.seconds / (1 << 20) : 0.0);
+		if (!r.error.empty())
+			std::cout << " error=" << r.error;
+		std::cout << std::endl;
+	};
+
+	// hands the next file to an idle slot, files that cannot start are reported right away
+	size_t next = 0;
+	size_t active = 0;
+	auto refill = [&](bulk_slot& slot)
+	{
+		while (next < files.size())
+		{
+			slot.result = next++;
+			if (start_transfer(multi.get(), slot, url, files[slot.result], encoding, results[slot.result]))
+			{
+				++active;
+				return;
+			}
+			print(results[slot.result]);
+		}
+	};
+
+	auto begin = std::chrono::steady_clock::now();
+	for (auto& slot : slots)
+		refill(slot);
+
+	run_transfers(multi.get(), active, [&](CURLMsg* msg)
+	{
+		bulk_slot* slot = nullptr;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &slot);
+		auto& result = results[slot->result];
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &result.status);
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_TOTAL_TIME, &result.seconds);
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_SIZE_UPLOAD_T, &result.sent_bytes);
+		if (CURLE_OK != msg->data.result)
+			result.error = curl_easy_strerror(msg->data.result);
+		else if (result.status >= 400)
+			result.error = slot->response.empty() ? "HTTP error" : slot->response;
+		print(result);
+
+		curl_multi_remove_handle(multi.get(), msg->easy_handle);
+		slot->body.file.close();
+		--active;
+		refill(*slot);
+	});
+	auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	// summary over the uploaded files
+	std::vector<double> latencies;
+	size_t failed = 0;
+	uint64_t bytes = 0;
+	for (auto const& r : results)
+	{
+		if (!r.error.empty())
+		{
+			++failed;
+			continue;
+		}
+		latencies.push_back(r.seconds);
+		bytes += r.bytes;
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](double p)
+	{
+		if (latencies.empty())
+			return 0.0;
+		return latencies[std::min(latencies.size() - 1, static_cast<size_t>(p * latencies.size()))];
+	};
+
+	elapsed = std::max(elapsed, 1e-9);
+	std::cout << "files=" << results.size() << " failed=" << failed << " bytes=" << bytes
+		<< " seconds=" << elapsed
+		<< " files_per_second=" << latencies.size() / elapsed
+		<< " mb_per_second=" << bytes / elapsed / (1 << 20)
+		<< " p50_seconds=" << percentile(0.50)
+		<< " p99_seconds=" << percentile(0.99) << std::endl;
+	return 0 == failed ? 0 : 1;
+}
+
+// a bodyless request of the resumable upload protocol, true on a 2xx
+bool upload_request(
+	CURL* curl,
+	std::string const& url,
+	std::vector<std::string> const& fields,
+	std::string& response)
+{
+	curl_slist* chunck = nullptr;
+	chunck = curl_slist_append(chunck, post_file_buf);
+	for (auto const& field : fields)
+		chunck = curl_slist_append(chunck, field.c_str());
+	std::unique_ptr<curl_slist, curl_delete_slist> headerlist;
+	headerlist.reset(chunck);
+
+	response.clear();
+	curl_easy_reset(curl);
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headerlist.get());
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDS, "");
+	curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(0));
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, recv_func);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+	curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+
+	long status = 0;
+	if (CURLE_OK != curl_easy_perform(curl))
+		return false;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+	return 2 == status / 100;
+}
+
+struct chunk_slot
+{
+	std::unique_ptr<CURL, curl_delete>				curl;
+	std::unique_ptr<curl_slist, curl_delete_slist>	headers;
+	std::string										response;
+	uint64_t										index = 0;
+	size_t											attempts = 0;
+};
+
+// sends the chunks of missing straight from the mapping, what still fails after a few attempts is left in missing
+uint64_t post_chunks(
+	std::string const& url,
+	std::string const& id,
+	mapped_file& file,
+	uint64_t chunk_size,
+	std::vector<uint64_t>& missing,
+	long concurrency)
+{
+	std::unique_ptr<CURLM, curl_delete_multi> multi;
+	multi.reset(new_multi(concurrency));
+	if (!multi)
+		return 0;
+
+	std::deque<std::pair<uint64_t, size_t>> pending;		// chunk# and attempts so far
+	for (auto index : missing)
+		pending.emplace_back(index, 0);
+	missing.clear();
+
+	std::vector<chunk_slot> slots(static_cast<size_t>(concurrency));
+	size_t active = 0;
+	uint64_t sent = 0;
+	auto refill = [&](chunk_slot& slot)
+	{
+		while (!pending.empty())
+		{
+			std::tie(slot.index, slot.attempts) = pending.front();
+			pending.pop_front();
+
+			auto offset = slot.index * chunk_size;
+			auto size = std::min<uint64_t>(chunk_size, file.size() - offset);
+			boost::crc_32_type crc;
+			crc.process_bytes(file.data() + offset, static_cast<size_t>(size));
+
+			if (!slot.curl)
+				slot.curl.reset(curl_easy_init());
+			if (!slot.curl)
+			{
+				missing.push_back(slot.index);
+				continue;
+			}
+
+			curl_slist* chunck = nullptr;
+			chunck = curl_slist_append(chunck, post_file_buf);
+			chunck = curl_slist_append(chunck, (std::string{ post_file_upload } + "chunk").c_str());
+			chunck = curl_slist_append(chunck, (post_file_upload_id + id).c_str());
+			chunck = curl_slist_append(chunck, (post_file_upload_offset + std::to_string(offset)).c_str());
+			chunck = curl_slist_append(chunck, (post_file_upload_crc32 + std::to_string(crc.checksum())).c_str());
+			slot.headers.reset(chunck);
+			slot.response.clear();
+
+			auto curl = slot.curl.get();
+			curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+			curl_easy_setopt(curl, CURLOPT_HTTPHEADER, slot.headers.get());
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, file.data() + offset);
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(size));
+			curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, recv_func);
+			curl_easy_setopt(curl, CURLOPT_WRITEDATA, &slot.response);
+			curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+			curl_easy_setopt(curl, CURLOPT_PRIVATE, &slot);
+			if (CURLM_OK != curl_multi_add_handle(multi.get(), curl))
+			{
+				missing.push_back(slot.index);
+				continue;
+			}
+
+			++active;
+			return;
+		}
+	};
+
+	for (auto& slot : slots)
+		refill(slot);
+
+	run_transfers(multi.get(), active, [&](CURLMsg* msg)
+	{
+		chunk_slot* slot = nullptr;
+		long status = 0;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &slot);
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &status);
+		auto offset = slot->index * chunk_size;
+		auto size = std::min<uint64_t>(chunk_size, file.size() - offset);
+
+		if (CURLE_OK == msg->data.result && 2 == status / 100)
+		{
+			sent += size;
+			file.release(static_cast<size_t>(offset), static_cast<size_t>(offset + size));
+		}
+		else if (slot->attempts + 1 < post_file_resume_attempts)
+		{
+			pending.emplace_back(slot->index, slot->attempts + 1);
+		}
+		else
+		{
+			std::cout << "chunk " << slot->index << " failed: "
+				<< (CURLE_OK != msg->data.result ? curl_easy_strerror(msg->data.result) : slot->response) << std::endl;
+			missing.push_back(slot->index);
+		}
+
+		curl_multi_remove_handle(multi.get(), msg->easy_handle);
+		--active;
+		refill(*slot);
+	});
+
+	std::sort(missing.begin(), missing.end());
+	return sent;
+}
+
+// uploads the chunks the server does not have yet, then completes the upload
+int post_file_resumable(
+	std::string const& url,
+	std::string const& file_name,
+	long concurrency)
+{
+	mapped_file file;
+	if (!file.open(file_name))
+	{
+		std::cout << "File: " << file_name << " not exists!" << std::endl;
+		return 1;
+	}
+
+	std::unique_ptr<CURL, curl_delete> curl;
+	curl.reset(curl_easy_init());
+	if (!curl)
+	{
+		std::cout << "Failed to initialize curl!" << std::endl;
+		return 1;
+	}
+
+	auto const upload = std::string{ post_file_upload };
+	auto const state_name = file_name + post_file_upload_state;
+	std::string id;
+	std::string response;
+	uint64_t chunk_size = 0;
+	std::vector<uint64_t> missing;
+
+	// the upload of an earlier run, if the server still knows it
+	{
+		std::ifstream state{ state_name };
+		if (state >> id && upload_request(curl.get(), url, { upload + "status", post_file_upload_id + id }, response))
+		{
+			std::istringstream is{ response };
+			is >> chunk_size;
+			for (uint64_t index; is >> index; )
+				missing.push_back(index);
+		}
+	}
+
+	if (0 == chunk_size)
+	{
+		if (!upload_request(curl.get(), url, { upload + "begin", post_file_file_name + file_name,
+			post_file_file_size + std::to_string(file.size()) }, response))
+		{
+			std::cout << "Failed to begin upload: " << response << std::endl;
+			return 1;
+		}
+
+		std::istringstream is{ response };
+		if (!(is >> id >> chunk_size) || 0 == chunk_size)
+		{
+			std::cout << "Unexpected response to begin: " << response << std::endl;
+			return 1;
+		}
+
+		std::ofstream{ state_name } << id << std::endl;
+		missing.clear();
+		for (uint64_t index = 0; index * chunk_size < file.size(); ++index)
+			missing.push_back(index);
+	}
+
+	// chunks the server asks for must lie in the file, an offset past its end reads beyond the mapping
+	auto chunks = file.size() / chunk_size + (0 != file.size() % chunk_size ? 1 : 0);
+	for (auto index : missing)
+	{
+		if (index >= chunks)
+		{
+			std::cout << "Upload " << id << " asks for chunk " << index << " of " << chunks
+				<< ", remove " << state_name << " to start over." << std::endl;
+			return 1;
+		}
+	}
+
+	std::cout << "upload " << id << " chunk_size=" << chunk_size << " missing=" << missing.size() << std::endl;
+
+	auto begin = std::chrono::steady_clock::now();
+	auto sent = post_chunks(url, id, file, chunk_size, missing, concurrency);
+	auto elapsed = std::max(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count(), 1e-9);
+	std::cout << "sent_bytes=" << sent << " seconds=" << elapsed
+		<< " mb_per_second=" << sent / elapsed / (1 << 20) << std::endl;
+
+	if (!missing.empty())
+	{
+		std::cout << missing.size() << " chunks failed, run again to resume." << std::endl;
+		return 1;
+	}
+
+	if (!upload_request(curl.get(), url, { upload + "complete", post_file_upload_id + id }, response))
+	{
+		std::cout << "Failed to complete upload: " << response << std::endl;
+		return 1;
+	}
+
+	std::remove(state_name.c_str());
+	std::cout << response << std::endl;
+	return 0;
+}
+
+size_t recv_func(char* ptr, size_t size, size_t nmemb, void* data)
+{
+	auto sizes = size * nmemb;
 	auto& content = *reinterpret_cast<std::string*>(data);
-	content.append(reinterpret_cast<char*>(ptr), sizes);
+	content.append(ptr, sizes);
 	return sizes;
-}
\ No newline at end of file
+}
+
+// keeps the resident part of a large file bounded
+void release_sent(upload_body& body, size_t before)
+{
+	auto window = body.offset - body.offset % post_file_release_size;
+	if (window > before)
+		body.file.release(before - before % post_file_release_size, window);
+}
+
+// compressed output of the file or the stream, 0 once the frame is complete
+size_t send_encoded(upload_body& body, char* out, size_t capacity)
+{
+	for (;;)
+	{
+		char const* input = nullptr;
+		size_t size = 0;
+		if (nullptr != body.stream)
+		{
+			if (body.input_offset == body.input.size() && !body.eof)
+			{
+				body.input.resize(post_file_stream_buffer_size);
+				auto read = std::fread(&body.input[0], 1, body.input.size(), body.stream);
+				if (read < body.input.size() && std::ferror(body.stream))
+					return CURL_READFUNC_ABORT;
+				body.eof = read < body.input.size();
+				body.input.resize(read);
+				body.input_offset = 0;
+			}
+			input = body.input.data() + body.input_offset;
+			size = body.input.size() - body.input_offset;
+		}
+		else
+		{
+			input = body.file.data() + body.offset;
+			size = body.file.size() - body.offset;
+		}
+
+		auto last = nullptr == body.stream || body.eof;
+		auto taken = size;
+		auto produced = body.encoder->encode(input, size, last, out, capacity);
+		taken -= size;
+		if (nullptr != body.stream)
+		{
+			body.input_offset += taken;
+		}
+		else
+		{
+			auto before = body.offset;
+			body.offset += taken;
+			release_sent(body, before);
+		}
+
+		// without output the encoder wants more input, unless the frame is done
+		if (produced > 0 || last)
+			return produced;
+	}
+}
+
+size_t send_func(char* ptr, size_t size, size_t nmemb, void* data)
+{
+	auto& body = *reinterpret_cast<upload_body*>(data);
+	auto sizes = size * nmemb;
+	if (body.encoder)
+	{
+		try
+		{
+			return send_encoded(body, ptr, sizes);
+		}
+		catch (std::exception const& e)
+		{
+			std::cout << "Failed to encode: " << e.what() << std::endl;
+			return CURL_READFUNC_ABORT;
+		}
+	}
+
+	if (nullptr != body.stream)
+	{
+		auto read = std::fread(ptr, 1, sizes, body.stream);
+		if (read < sizes && std::ferror(body.stream))
+			return CURL_READFUNC_ABORT;
+		return read;
+	}
+
+	sizes = std::min(sizes, body.file.size() - body.offset);
+	if (sizes > 0)
+		std::memcpy(ptr, body.file.data() + body.offset, sizes);
+	body.offset += sizes;
+	release_sent(body, body.offset - sizes);
+	return sizes;
+}
+
+int seek_func(void* data, curl_off_t offset, int origin)
+{
+	auto& body = *reinterpret_cast<upload_body*>(data);
+	if (SEEK_SET != origin || offset < 0 || static_cast<size_t>(offset) > body.file.size())
+		return CURL_SEEKFUNC_CANTSEEK;
+
+	body.offset = static_cast<size_t>(offset);
+	return CURL_SEEKFUNC_OK;
+}
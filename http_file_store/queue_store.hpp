@@ -4,117 +4,110 @@
 #include <memory>
 #include <type_traits>
 #include <thread>
+#include <map>
+#include <algorithm>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <future>
+#include <functional>
+#include <condition_variable>
+#include <atomic>
+#include <shared_mutex>
+#include <unordered_map>
+#include <limits>
+#include <random>
+#include <cerrno>
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <limits.h>
+#endif
+#include <boost/functional/hash.hpp>
 #include <boost/uuid/name_generator.hpp>
 #include <boost/uuid/string_generator.hpp>
 #include <rocksdb/db.h>
 #include <rocksdb/slice.h>
 #include <rocksdb/options.h>
-//#include <rocksdb/merge_operator.h>
+#include <rocksdb/write_batch.h>
+#include <rocksdb/compaction_filter.h>
+#include <rocksdb/table.h>
+#include <rocksdb/cache.h>
+#include <rocksdb/filter_policy.h>
+#include <rocksdb/slice_transform.h>
+#include <rocksdb/merge_operator.h>
 #include <rocksdb/utilities/transaction.h>
 #include <rocksdb/utilities/transaction_db.h>
+#include "coding.hpp"
+#include "store_stats.hpp"
 
 namespace timax
 {
-	inline void encode_fixed_32(char* dst, uint64_t value)
-	{
-		dst[0] = value & 0xff;
-		dst[1] = (value >> 8) & 0xff;
-		dst[2] = (value >> 16) & 0xff;
-		dst[3] = (value >> 24) & 0xff;
-	}
+	/* message index inside a topic partition */
+	using index_type = uint64_t;
 
-	inline void encode_fixed_64(char* dst, uint64_t value)
-	{
-		dst[0] = value & 0xff;
-		dst[1] = (value >> 8) & 0xff;
-		dst[2] = (value >> 16) & 0xff;
-		dst[3] = (value >> 24) & 0xff;
-		dst[4] = (value >> 32) & 0xff;
-		dst[5] = (value >> 40) & 0xff;
-		dst[6] = (value >> 48) & 0xff;
-		dst[7] = (value >> 56) & 0xff;
-	}
-
-	inline uint32_t decode_fixed_32(char const* ptr)
+	/* fixed size queue key on the stack: topic uuid + big endian index */
+	class queue_key
 	{
-		return ((static_cast<uint32_t>(static_cast<unsigned char>(ptr[0])))
-			| (static_cast<uint32_t>(static_cast<unsigned char>(ptr[1])) << 8)
-			| (static_cast<uint32_t>(static_cast<unsigned char>(ptr[2])) << 16)
-			| (static_cast<uint32_t>(static_cast<unsigned char>(ptr[3])) << 24));
-	}
+	public:
+		static constexpr size_t static_size = boost::uuids::uuid::static_size() + sizeof(index_type);
 
-	inline uint64_t decode_fixed_64(char const* ptr)
-	{
-		uint64_t const lo = decode_fixed_32(ptr);
-		uint64_t const hi = decode_fixed_32(ptr + 4);
-		return (hi << 32) | lo;
-	}
+		queue_key(boost::uuids::uuid const& prefix, index_type queue_index) noexcept
+		{
+			std::copy(prefix.begin(), prefix.end(), data_);
+			detail::encode_big_endian_64(data_ + boost::uuids::uuid::static_size(), queue_index);
+		}
 
-	inline void put_fixed_32(std::string* dst, uint32_t value)
-	{
-		char buf[sizeof(value)];
-		encode_fixed_32(buf, value);
-		dst->append(buf, sizeof(buf));
-	}
+		char const* data() const noexcept
+		{
+			return data_;
+		}
 
-	inline void put_fixed_64(std::string* dst, uint64_t value)
-	{
-		char buf[sizeof(value)];
-		encode_fixed_64(buf, value);
-		dst->append(buf, sizeof(buf));
-	}
+		constexpr size_t size() const noexcept
+		{
+			return static_size;
+		}
 
-	namespace detail
-	{
-		inline static uint32_t swap_endian(uint32_t value)
+		operator rocksdb::Slice() const noexcept
+		{
+			return { data_, static_size };
+		}
+
+		// the index part of a key read back from rocksdb
+		static index_type index_of(rocksdb::Slice const& key) noexcept
 		{
-			return ((value & 0x000000FF) << 24 |
-				(value & 0x0000FF00) << 8 |
-				(value & 0x00FF0000) >> 8 |
-				(value & 0xFF000000) >> 24);
+			return detail::decode_big_endian_64(key.data() + boost::uuids::uuid::static_size());
 		}
-	}
+
+	private:
+		char						data_[static_size];
+	};
 
 	/* queue index generator*/
 	class queue_generator
 	{
-		static constexpr size_t static_key_size = boost::uuids::uuid::static_size() + sizeof(uint32_t);
 	public:
 		queue_generator()
 			: seed_(boost::uuids::string_generator{}("c6c697f3-ca98-420b-bdbf-d4390ac025cf"))
 		{
 		}
 
-		std::string operator() (std::string const& queue_name, uint32_t queue_index) const
+		std::string operator() (std::string const& queue_name, index_type queue_index) const
+		{
+			queue_key key{ prefix(queue_name), queue_index };
+			return { key.data(), key.size() };
+		}
+
+		// the per queue part of the key, hash it once when building many keys
+		boost::uuids::uuid prefix(std::string const& queue_name) const
 		{
 			// create generator
 			boost::uuids::name_generator gen{ seed_ };
-
-			// prepare buffer
-			std::string key;
-			key.resize(static_key_size);
-
-			// generator key
-			auto uuid = gen(queue_name.c_str());
-
-			// generator index
-			queue_index = swap_endian(queue_index);
-
-			// copy
-			std::copy(uuid.begin(), uuid.end(), key.begin());
-			std::memcpy(&key[boost::uuids::uuid::static_size()], &queue_index, sizeof(uint32_t));
-
-			return key;
+			return gen(queue_name.c_str());
 		}
 
-	private:
-
-		static uint32_t swap_endian(uint32_t value)
+		queue_key operator() (boost::uuids::uuid const& prefix, index_type queue_index) const noexcept
 		{
-			return ((value & 0x000000FF) << 24 |
-				(value & 0x0000FF00) << 8 |
-				(value & 0x00FF0000) >> 8 |
-				(value & 0xFF000000) >> 24);
+			return { prefix, queue_index };
 		}
 
 	private:
@@ -183,7 +176,7 @@ namespace timax
 	};
 
 	/*rocksdb merge operator*/
-	/*template <typename T>
+	template <typename T>
 	class integral_merge_operator : public rocksdb::AssociativeMergeOperator
 	{
 		static_assert(std::is_integral<T>::value, "Type T is not integral!");
@@ -195,20 +188,22 @@ namespace timax
 		integral_merge_operator() = default;
 		~integral_merge_operator() override = default;
 
-		virtual bool Merge(const rocksdb::Slice& key,
+		virtual bool Merge(const rocksdb::Slice& /*key*/,
 			const rocksdb::Slice* existing_value,
 			const rocksdb::Slice& value,
 			std::string* new_value,
-			rocksdb::Logger* logger) const override
+			rocksdb::Logger* /*logger*/) const override
 		{
 			assert(new_value);
-			assert(new_value->empty());
 			if (value.size() != sizeof(value_type))
 				return false;
 
-			value_type orig_value = rit::default_value();
+			// merged counters start from zero, indexes are never merged
+			value_type orig_value = 0;
 			if (existing_value) 
 			{
+				if (existing_value->size() != sizeof(value_type))
+					return false;
 				orig_value = rit::decode(existing_value->data());
 			}
 			value_type operand = rit::decode(value.data());
@@ -222,7 +217,7 @@ namespace timax
 		{
 			return rit::name();
 		}
-	};*/
+	};
 
 	using normal_db_t = std::unique_ptr<rocksdb::DB>;
 	using transaction_db_t = std::unique_ptr<rocksdb::TransactionDB>;
@@ -235,7 +230,10 @@ namespace timax
 		using rit = rocksdb_ingtegral_tratis<value_type>;
 
 	public:
-		/*static bool fetch_add(rocksdb::Transaction* txn,
+		// Writer is a rocksdb::Transaction or a rocksdb::WriteBatch, the column family
+		// needs an integral_merge_operator<value_type>; wraps around like unsigned arithmetic
+		template <typename Writer>
+		static bool fetch_add(Writer* writer,
 			rocksdb::ColumnFamilyHandle* handle,
 			std::string const& key,
 			value_type value)
@@ -243,22 +241,23 @@ namespace timax
 			char encoded[sizeof(value_type)];
 			rit::encode(encoded, value);
 			rocksdb::Slice slice(encoded, sizeof(value_type));
-			auto s = txn->Merge(handle, key, slice);
+			auto s = writer->Merge(handle, key, slice);
 			return s.ok();
-		}*/
+		}
 
 		template <typename DB>
 		static bool get(DB const& db,
 			rocksdb::ReadOptions const& option,
 			rocksdb::ColumnFamilyHandle* handle,
 			std::string const& key,
-			value_type& value)
+			value_type& value,
+			value_type missing = rit::default_value())
 		{
 			std::string str;
 			auto s = db->Get(option, handle, key, &str);
 			if (s.IsNotFound())
 			{
-				value = rit::default_value();
+				value = missing;
 				return true;
 			}
 
@@ -276,14 +275,16 @@ namespace timax
 			return false;
 		}
 
-		static bool put(rocksdb::Transaction* txn,
+		// Writer is a rocksdb::Transaction or a rocksdb::WriteBatch
+		template <typename Writer>
+		static bool put(Writer* writer,
 			rocksdb::ColumnFamilyHandle* handle,
 			std::string const& key,
 			value_type value)
 		{
-			char value_str[sizeof(uint32_t)];
-			encode_fixed_32(value_str, value);
-			auto s = txn->Put(handle, key, rocksdb::Slice{ value_str, sizeof(value_str) });
+			char value_str[sizeof(value_type)];
+			rit::encode(value_str, value);
+			auto s = writer->Put(handle, key, rocksdb::Slice{ value_str, sizeof(value_str) });
 			return s.ok();
 		}
 
@@ -381,238 +382,1919 @@ namespace timax
 		rocksdb::Snapshot const*	snapshot_ = nullptr;
 	};
 
-	class queue_store
+	/* how much of a topic to keep, 0 means no limit */
+	struct retention_policy
 	{
-		using value_type = uint32_t;
-		//using counter_merge_operator = integral_merge_operator<value_type>;
-		using queue_counter_t = queue_counter<value_type>;
-		using column_family_handles_t = std::vector<rocksdb::ColumnFamilyHandle*>;
-		
+		std::chrono::seconds		max_age{ 0 };
+		uint64_t					max_messages = 0;
+		uint64_t					max_bytes = 0;
+	};
+
+	/* committed read position of one consumer group on one topic */
+	struct consumer_group_state
+	{
+		consumer_group_state(std::string const& group, std::string const& topic)
+			: offset_key(group + "@" + topic + "_offset")
+			, delivered_key(group + "@" + topic + "_delivered")
+		{
+		}
+
+		std::string const			offset_key;
+		std::string const			delivered_key;		// merged counter of delivered messages
+
+		// held for a whole poll, consumers of one group never see the same message twice
+		std::mutex					mutex;
+		bool						loaded = false;
+		index_type					offset = 0;
+	};
+
+	/* in memory state of a topic, authoritative while the store is open */
+	struct topic_state
+	{
+		using value_type = index_type;
+
+		topic_state(std::string topic, boost::uuids::uuid const& topic_prefix)
+			: name(std::move(topic))
+			, prefix(topic_prefix)
+			, head_key(name + "_head")
+			, tail_key(name + "_tail")
+			, bytes_key(name + "_bytes")
+		{
+		}
+
+		topic_state(topic_state const&) = delete;
+		topic_state& operator= (topic_state const&) = delete;
+
+		// interned name, key prefix and meta keys
+		std::string const			name;
+		boost::uuids::uuid const	prefix;
+		std::string const			head_key;
+		std::string const			tail_key;
+		std::string const			bytes_key;
+
+		std::atomic<value_type>		head{ rocksdb_ingtegral_tratis<value_type>::default_value() };
+		std::atomic<value_type>		next{ rocksdb_ingtegral_tratis<value_type>::default_value() };	// next index handed out
+		std::atomic<value_type>		tail{ rocksdb_ingtegral_tratis<value_type>::default_value() };	// all below are committed
+		std::atomic<value_type>		turn{ rocksdb_ingtegral_tratis<value_type>::default_value() };	// first index of the append to go next
+		std::atomic<uint64_t>		bytes{ 0 };
+		std::atomic<size_t>			partitions{ 1 };	// of the topic, kept on partition 0
+
+		// statistics since the store was opened
+		std::atomic<uint64_t>		appended_messages{ 0 };
+		std::atomic<uint64_t>		appended_bytes{ 0 };
+		std::atomic<uint64_t>		commit_failures{ 0 };
+		std::atomic<uint64_t>		conflict_retries{ 0 };
+
+		// appends of a topic commit in index order
+		std::mutex					commit_mutex;
+		std::condition_variable		commit_cv;
+
+		// long polling consumers wait here for the tail to move
+		std::mutex					data_mutex;
+		std::condition_variable		data_cv;
+		std::atomic<int>			pollers{ 0 };
+
+		// consumer groups reading this topic
+		std::mutex					groups_mutex;
+		std::map<std::string, std::unique_ptr<consumer_group_state>>	groups;
+
+		// held while truncating, guards the policy too
+		std::mutex					retention_mutex;
+		bool						has_retention = false;
+		retention_policy			retention;
+	};
+
+	/* sharded topic name -> topic_state table, states live as long as the table */
+	class topic_meta_table
+	{
+		static constexpr size_t shard_count = 16;
+		using read_lock_t = std::shared_lock<std::shared_mutex>;
+		using write_lock_t = std::unique_lock<std::shared_mutex>;
+		using topics_t = std::unordered_map<std::string, std::unique_ptr<topic_state>>;
+
+		struct shard
+		{
+			mutable std::shared_mutex	mutex;
+			topics_t					topics;
+		};
+
 	public:
-		explicit queue_store(std::string const& path)
+		topic_state* find(std::string const& topic) const
 		{
-			init(path);
+			auto& s = shard_of(topic);
+			read_lock_t lock{ s.mutex };
+			auto itr = s.topics.find(topic);
+			return s.topics.end() == itr ? nullptr : itr->second.get();
 		}
 
-		~queue_store()
+		topic_state& get_or_create(std::string const& topic, queue_generator const& gen)
 		{
-			if (db_)
+			if (auto state = find(topic))
+				return *state;
+
+			auto& s = shard_of(topic);
+			write_lock_t lock{ s.mutex };
+			auto& state = s.topics[topic];
+			if (!state)
+				state = std::make_unique<topic_state>(topic, gen.prefix(topic));
+			return *state;
+		}
+
+		template <typename F>
+		void for_each(F&& f) const
+		{
+			for (auto const& s : shards_)
 			{
-				for(auto handle : handles_)
-				{
-					if (handle)
-						db_->DestroyColumnFamilyHandle(handle);
-				}
+				read_lock_t lock{ s.mutex };
+				for (auto const& topic : s.topics)
+					f(*topic.second);
 			}
 		}
 
-		queue_store(queue_store const&) = delete;
-		queue_store& operator= (queue_store const&) = delete;
-
-		bool push_back(std::string const& topic, std::string const& value)
+	private:
+		shard& shard_of(std::string const& topic) const
 		{
-			std::string topic_tail = topic + "_tail";
+			return shards_[std::hash<std::string>{}(topic) % shard_count];
+		}
 
-			auto txn_raw = db_->BeginTransaction(rocksdb::WriteOptions{});
-			rocksdb_txn_rollback_guard txn = txn_raw;
+	private:
+		mutable shard					shards_[shard_count];
+	};
 
-			// get the tail index and lock
-			value_type index;
-			if (!queue_counter_t::get_for_update(txn.get(), topic_meta_handle_, topic_tail, index))
-				return false;
+	/* interned topic handle from queue_store::open_topic, valid as long as the store */
+	class topic_id
+	{
+		friend class queue_store;
 
-			// update index
-			if (!queue_counter_t::put(txn.get(), topic_meta_handle_, topic_tail, index + 1))
-				return false;
+	public:
+		topic_id() = default;
 
-			auto key = gen_(topic, index);
-			rocksdb::Status s;
-			// enqueue
-			s = txn->Put(default_hanle_, key, value);
-			if (!s.ok())
-				return false;
+		std::string const& name() const noexcept
+		{
+			return state_->name;
+		}
 
-			// commit 
-			s = txn->Commit();
-			if (!s.ok())
-				return false;
+		boost::uuids::uuid const& prefix() const noexcept
+		{
+			return state_->prefix;
+		}
 
-			txn.dismiss();
-			return true;
+		explicit operator bool() const noexcept
+		{
+			return nullptr != state_;
 		}
 
-		bool get_message(std::string const& topic, value_type index, std::string& value)
+	private:
+		explicit topic_id(topic_state* state) noexcept
+			: state_(state)
 		{
-			auto key = gen_(topic, index);
-			auto s = db_->Get(rocksdb::ReadOptions{}, default_hanle_,  key, &value);
-			return s.ok();
 		}
 
-		bool get_message(std::string const& topic, value_type begin, value_type end, std::string& value)
+	private:
+		topic_state*				state_ = nullptr;
+	};
+
+	/* drops queue keys below the head of their topic, so truncated prefixes are reclaimed by compaction */
+	class retention_filter : public rocksdb::CompactionFilter
+	{
+		using read_lock_t = std::shared_lock<std::shared_mutex>;
+		using write_lock_t = std::unique_lock<std::shared_mutex>;
+		using heads_t = std::unordered_map<boost::uuids::uuid, index_type, boost::hash<boost::uuids::uuid>>;
+
+	public:
+		void set_head(boost::uuids::uuid const& prefix, index_type head)
 		{
-			std::string topic_head_key = topic + "_head";
-			std::string topic_tail_key = topic + "_tail";
-			value_type head_index = 0, tail_index = 0;
-			
-			rocksdb::ReadOptions op;
+			write_lock_t lock{ mutex_ };
+			heads_[prefix] = head;
+		}
 
-			auto snapshot = db_->GetSnapshot();
-			if (nullptr == snapshot)
-				return false;
-			
-			rocksdb_snapshot_guard snapshort_guard = { db_.get(), snapshot };
-			op.snapshot = snapshot;
-	
-			if (!queue_counter_t::get(db_, op, topic_meta_handle_, topic_head_key, head_index))
-				return false;
-			if (!queue_counter_t::get(db_, op, topic_meta_handle_, topic_tail_key, tail_index))
+		bool Filter(int /*level*/, rocksdb::Slice const& key, rocksdb::Slice const& /*existing_value*/,
+			std::string* /*new_value*/, bool* /*value_changed*/) const override
+		{
+			if (key.size() != queue_key::static_size)
 				return false;
 
-			if (begin < head_index)
-				begin = head_index;
-			if (end > tail_index)
-				end = tail_index;
+			boost::uuids::uuid prefix;
+			std::memcpy(prefix.data, key.data(), boost::uuids::uuid::static_size());
 
-			auto tail_key = gen_(topic, end);
-			auto head_key = gen_(topic, begin);
+			read_lock_t lock{ mutex_ };
+			auto itr = heads_.find(prefix);
+			return heads_.end() != itr && queue_key::index_of(key) < itr->second;
+		}
 
-			rocksdb::Slice upper_bound = tail_key;
-			op.iterate_upper_bound = &upper_bound;
+		char const* Name() const override
+		{
+			return "timax_retention_filter";
+		}
 
-			auto itr_raw = db_->NewIterator(op, default_hanle_);
-			if (nullptr == itr_raw)
-				return false;
+	private:
+		mutable std::shared_mutex		mutex_;
+		heads_t							heads_;
+	};
 
-			std::unique_ptr<rocksdb::Iterator> itr{ itr_raw };
+	struct retention_options
+	{
+		// how often the store enforces retention by itself, 0 leaves it to enforce_retention()
+		std::chrono::seconds		check_interval{ 0 };
+		retention_policy			default_policy;
+	};
 
-			value.push_back('[');
-			itr->Seek(head_key);
-			while (itr->Valid())
+	/* group commit: producers stage messages, one committer thread flushes them */
+	struct group_commit_options
+	{
+		bool						enabled = false;
+		size_t						max_batch_size = 256;
+		std::chrono::microseconds	max_linger{ 1000 };
+	};
+
+	/* how writes ride out write stalls: with retry_write_stalls a write refused by a stall
+	   (WriteOptions::no_slowdown) backs off here instead of blocking in rocksdb, otherwise nothing
+	   is retried. writes skip the lock manager, so there are no busy statuses or lock timeouts;
+	   an append backs off in its topic's commit order, later appends of that topic wait behind it
+	   as they would behind the stall while other topics go on */
+	struct contention_options
+	{
+		size_t						max_retries = 8;			// 0 fails on the first stall
+		std::chrono::microseconds	initial_backoff{ 100 };		// doubled per retry, jittered
+		std::chrono::microseconds	max_backoff{ 20000 };
+		bool						retry_write_stalls = false;
+	};
+
+	enum class wal_sync_policy
+	{
+		buffered,					// leave flushing the WAL to the OS
+		sync,						// fsync the WAL on every commit
+		disabled,					// no WAL, unflushed memtables are lost on a crash
+	};
+
+	enum class queue_compaction_style
+	{
+		level,
+		universal,					// least write amplification for append only keys
+	};
+
+	/* column family profile for the append-by-increasing-key, scan-in-order queue access pattern */
+	struct tuning_options
+	{
+		bool						enabled = false;			// false keeps the rocksdb defaults
+		size_t						queue_block_cache_size = 32 << 20;
+		size_t						meta_block_cache_size = 64 << 20;
+		int							bloom_bits_per_key = 10;
+		size_t						write_buffer_size = 64 << 20;
+		queue_compaction_style		compaction_style = queue_compaction_style::universal;
+		wal_sync_policy				wal = wal_sync_policy::buffered;
+	};
+
+	/* what the store runs on, every engine has the same API */
+	enum class queue_engine
+	{
+		transactional,				// TransactionDB, transactions of other users can share the DB
+		plain,						// rocksdb::DB, appends of a topic still commit in index order
+		single_writer,				// rocksdb::DB, one appending thread per topic at a time, no commit ordering
+	};
+
+	/* picks the partition of a keyed message, partitions is at least 2; called concurrently */
+	using partitioner_t = std::function<size_t(std::string const& key, size_t partitions)>;
+
+	/* 64-bit fnv-1a, a key lands in the same partition whatever library or platform built the store */
+	struct hash_partitioner
+	{
+		size_t operator() (std::string const& key, size_t partitions) const
+		{
+			uint64_t hash = 14695981039346656037ull;
+			for (unsigned char c : key)
 			{
-				auto v = itr->value();
-				value.append(v.data(), v.size());
-				value.push_back(',');
-				itr->Next();
+				hash ^= c;
+				hash *= 1099511628211ull;
 			}
-			if (value.size() > 1)
-				value.back() = ']';
-			else
-				value.push_back(']');
+			return static_cast<size_t>(hash % partitions);
+		}
+	};
 
-			return true;
+	class round_robin_partitioner
+	{
+	public:
+		size_t operator() (std::string const& /*key*/, size_t partitions)
+		{
+			return next_->fetch_add(1, std::memory_order_relaxed) % partitions;
 		}
 
 	private:
-		void init(std::string const& path)
+		std::shared_ptr<std::atomic<size_t>>	next_ = std::make_shared<std::atomic<size_t>>(0);
+	};
+
+	/* same key same partition, messages without a key are spread round robin */
+	class default_partitioner
+	{
+	public:
+		size_t operator() (std::string const& key, size_t partitions)
 		{
-			init_db(path);
-			open_db(path);
+			return key.empty() ? round_robin_(key, partitions) : hash_(key, partitions);
 		}
 
-		void init_db(std::string const& path)
+	private:
+		hash_partitioner			hash_;
+		round_robin_partitioner		round_robin_;
+	};
+
+	struct queue_store_options
+	{
+		group_commit_options		group_commit;
+		retention_options			retention;
+		tuning_options				tuning;
+		contention_options			contention;
+		stats_options				stats;
+		partitioner_t				partitioner = default_partitioner{};
+
+		queue_engine				engine = queue_engine::transactional;
+	};
+
+	/* bounds of one range visit, at least one message is delivered if the range is not empty */
+	struct read_limits
+	{
+		size_t						max_messages = std::numeric_limits<size_t>::max();
+		uint64_t					max_bytes = std::numeric_limits<uint64_t>::max();
+	};
+
+	/* default end of a range visit, nothing left to do */
+	struct visit_done
+	{
+		bool operator() () const noexcept
 		{
-			using namespace rocksdb;
-			Status s;
+			return true;
+		}
+	};
 
-			DBOptions op;
-			op.create_if_missing = true;
+	/* what a range visit delivered, next is where the following page begins */
+	struct read_result
+	{
+		index_type					next = 0;
+		size_t						messages = 0;
+		uint64_t					bytes = 0;
+	};
 
-			// check db
-			std::vector<std::string> column_families;
-			DB::ListColumnFamilies(op, path, &column_families);
-			auto is_to_create_topic_meta_column_family =
-				std::find(column_families.begin(), column_families.end(),
-					topic_meta_column_family_name_) == column_families.end();
+	class queue_store
+	{
+		using value_type = index_type;
+		using counter_type = uint64_t;
+		using counter_merge_operator = integral_merge_operator<counter_type>;
+		using queue_counter_t = queue_counter<value_type>;
+		using stat_counter_t = queue_counter<counter_type>;
+		using column_family_handles_t = std::vector<rocksdb::ColumnFamilyHandle*>;
 
-			normal_db_t db;
-			if (is_to_create_topic_meta_column_family)
-			{
-				DB* db_raw = nullptr;
-				Options option;
-				option.create_if_missing = true;
-				s = DB::Open(option, path, &db_raw);
-				if (Status::OK() != s)
-				{
-					assert(nullptr == db_raw);
-					throw std::runtime_error{ s.getState() };
-				}
+		// layout of keys and counters kept in topic meta, 1 had 32-bit indexes
+		static constexpr uint64_t format_version = 2;
 
-				assert(db_raw);
-				db.reset(db_raw);
-				ColumnFamilyHandle* handle_raw = nullptr;
-				s = db->CreateColumnFamily(ColumnFamilyOptions{},
-					topic_meta_column_family_name_, &handle_raw);
-				if (Status::OK() != s)
-				{
-					assert(nullptr == handle_raw);
-					throw std::runtime_error{ s.getState() };
-				}
+	public:
+		using push_callback_t = std::function<void(bool, value_type)>;
 
-				assert(handle_raw);
-				db->DestroyColumnFamilyHandle(handle_raw);
-			}
-		}
+		// [begin, end) of the indexes assigned to an append
+		struct index_range
+		{
+			value_type				begin = 0;
+			value_type				end = 0;
+		};
 
-		void open_db(std::string const& path)
+		struct consumer_info
 		{
-			using namespace rocksdb;
-			Status s;
+			value_type				offset = 0;
+			value_type				lag = 0;			// messages behind the tail
+			uint64_t				delivered = 0;
+		};
 
-			Options op;
-			op.IncreaseParallelism(std::thread::hardware_concurrency());
-			op.OptimizeLevelStyleCompaction();
-			op.create_if_missing = true;
-			//op.merge_operator = std::make_shared<counter_merge_operator>();
-			op.max_successive_merges = 5;
+		struct topic_info
+		{
+			value_type				head = 0;
+			value_type				tail = 0;
+			value_type				count = 0;
+			uint64_t				bytes = 0;
+			uint64_t				conflict_retries = 0;	// stalled writes retried
+			uint64_t				commit_failures = 0;	// appends that failed, retries included
+		};
 
-			TransactionDBOptions txn_op;
+	private:
+		struct pending_message
+		{
+			std::string				value;
+			push_callback_t			callback;
+		};
 
-			// open DB with two column families
-			std::vector<rocksdb::ColumnFamilyDescriptor> column_families;
-			// have to open default column family
-			column_families.push_back(ColumnFamilyDescriptor(
-				kDefaultColumnFamilyName, ColumnFamilyOptions{}));
-			// open the new one, too
-			column_families.push_back(ColumnFamilyDescriptor(
-				topic_meta_column_family_name_, ColumnFamilyOptions{}));
-			std::vector<ColumnFamilyHandle*> raw_handles;
+		using staging_t = std::map<topic_state*, std::vector<pending_message>>;
+		
+	public:
+		explicit queue_store(std::string const& path, queue_store_options const& options = queue_store_options{})
+			: options_(options)
+		{
+			init(path);
 
-			TransactionDB* db_raw = nullptr;
-			s = TransactionDB::Open(op, txn_op, path, column_families, &raw_handles, &db_raw);
-			if (Status::OK() != s)
-			{
-				assert(nullptr == db_raw);
-				throw std::runtime_error{ s.getState() };
-			}
-			assert(db_raw);
+			if (options_.group_commit.enabled)
+				committer_ = std::thread{ [this] { commit_loop(); } };
 
-			// cache db and handles with raii for exceptional safty
-			transaction_db_t db{ db_raw };
+			if (options_.retention.check_interval.count() > 0)
+				retention_thread_ = std::thread{ [this] { retention_loop(); } };
+		}
 
-			auto itr = std::find_if(raw_handles.begin(), raw_handles.end(),
-				[this](auto const& handle)
+		~queue_store()
+		{
+			if (retention_thread_.joinable())
 			{
-				return handle->GetName() == topic_meta_column_family_name_;
-			});
+				{
+					std::lock_guard<std::mutex> lock{ retention_wait_mutex_ };
+					retention_stopping_ = true;
+				}
+				retention_cv_.notify_one();
+				retention_thread_.join();
+			}
 
-			if (raw_handles.end() == itr)
+			// drain the staging buffer before the handles go away
+			if (committer_.joinable())
 			{
-				throw std::runtime_error{ "Rocksdb status is not inconsistence." };
+				{
+					std::lock_guard<std::mutex> lock{ staging_mutex_ };
+					stopping_ = true;
+				}
+				staging_cv_.notify_one();
+				committer_.join();
 			}
 
-			default_hanle_ = raw_handles[0];
-			topic_meta_handle_ = *itr;
-			handles_ = std::move(raw_handles);
-			db_ = std::move(db);
+			if (db_)
+			{
+				for(auto handle : handles_)
+				{
+					if (handle)
+						db_->DestroyColumnFamilyHandle(handle);
+				}
+			}
+		}
+
+		queue_store(queue_store const&) = delete;
+		queue_store& operator= (queue_store const&) = delete;
+
+		topic_id open_topic(std::string const& topic)
+		{
+			return topic_id{ &meta_.get_or_create(topic, gen_) };
+		}
+
+		// partition 0 is the topic itself, the others are independent queues named topic#partition
+		static std::string partition_name(std::string const& topic, size_t partition)
+		{
+			return 0 == partition ? topic : topic + "#" + std::to_string(partition);
+		}
+
+		topic_id open_partition(std::string const& topic, size_t partition)
+		{
+			return open_topic(partition_name(topic, partition));
+		}
+
+		// partitions only ever grow, so keyed messages keep their partition as long as possible
+		bool create_topic(std::string const& topic, size_t partitions)
+		{
+			auto& state = *open_topic(topic).state_;
+			std::lock_guard<std::mutex> lock{ partitions_mutex_ };
+			if (partitions <= state.partitions.load())
+				return true;
+
+			rocksdb::WriteBatch batch;
+			queue_counter_t::put(&batch, topic_meta_handle_, topic + partitions_suffix(), partitions);
+			if (!write(batch, &state).ok())
+				return false;
+
+			state.partitions.store(partitions);
+			return true;
+		}
+
+		size_t partitions(std::string const& topic) const
+		{
+			auto id = find_topic(topic);
+			return id ? id.state_->partitions.load() : 1;
+		}
+
+		bool push_back(std::string const& topic, std::string const& value)
+		{
+			return push_back(open_topic(topic), value);
+		}
+
+		// append to the partition the partitioner picks for key
+		bool push_back(std::string const& topic, std::string const& key, std::string const& value)
+		{
+			auto id = open_topic(topic);
+			auto partitions = id.state_->partitions.load();
+			if (partitions > 1)
+			{
+				auto partition = partitioner_(key, partitions) % partitions;
+				if (partition > 0)
+					id = open_partition(topic, partition);
+			}
+
+			return push_back(id, value);
+		}
+
+		bool push_back(topic_id topic, std::string const& value)
+		{
+			if (committer_.joinable())
+				return enqueue(topic, value).get();
+
+			index_range range;
+			return append(*topic.state_, &value, &value + 1, identity{}, range);
+		}
+
+		template <typename Messages>
+		bool push_back_many(std::string const& topic, Messages const& messages, index_range& range)
+		{
+			return push_back_many(open_topic(topic), messages, range);
+		}
+
+		template <typename Messages>
+		bool push_back_many(topic_id topic, Messages const& messages, index_range& range)
+		{
+			using std::begin;
+			using std::end;
+
+			range = {};
+			if (begin(messages) == end(messages))
+				return true;
+
+			return append(*topic.state_, begin(messages), end(messages), identity{}, range);
+		}
+
+		std::future<bool> enqueue(std::string const& topic, std::string value)
+		{
+			return enqueue(open_topic(topic), std::move(value));
+		}
+
+		std::future<bool> enqueue(topic_id topic, std::string value)
+		{
+			auto promise = std::make_shared<std::promise<bool>>();
+			auto result = promise->get_future();
+			enqueue(topic, std::move(value), [promise](bool ok, value_type)
+			{
+				promise->set_value(ok);
+			});
+			return result;
+		}
+
+		void enqueue(std::string const& topic, std::string value, push_callback_t callback)
+		{
+			enqueue(open_topic(topic), std::move(value), std::move(callback));
+		}
+
+		void enqueue(topic_id topic, std::string value, push_callback_t callback)
+		{
+			if (!committer_.joinable())
+			{
+				index_range range;
+				auto ok = append(*topic.state_, &value, &value + 1, identity{}, range);
+				if (callback)
+					callback(ok, range.begin);
+				return;
+			}
+
+			std::unique_lock<std::mutex> lock{ staging_mutex_ };
+			staging_[topic.state_].push_back({ std::move(value), std::move(callback) });
+			auto staged = ++staged_count_;
+			lock.unlock();
+
+			// wake the committer on the first message and on a full batch
+			if (1 == staged || staged >= options_.group_commit.max_batch_size)
+				staging_cv_.notify_one();
+		}
+
+		bool get_message(std::string const& topic, value_type index, std::string& value)
+		{
+			return get_message(find_topic(topic), index, value);
+		}
+
+		bool get_message(topic_id topic, value_type index, std::string& value)
+		{
+			auto state = topic.state_;
+			if (nullptr == state || index < state->head.load() || index >= state->tail.load())
+				return false;
+
+			scoped_latency latency{ timed(latencies_.point_read) };
+			scoped_perf_context perf{ perf_context() };
+			auto s = db_->Get(rocksdb::ReadOptions{}, default_hanle_, gen_(state->prefix, index), &value);
+			return s.ok();
+		}
+
+		bool get_message(std::string const& topic, value_type begin, value_type end, std::string& value)
+		{
+			return get_message(find_topic(topic), begin, end, value);
+		}
+
+		bool get_message(topic_id topic, value_type index, rocksdb::PinnableSlice& value)
+		{
+			auto state = topic.state_;
+			if (nullptr == state || index < state->head.load() || index >= state->tail.load())
+				return false;
+
+			scoped_latency latency{ timed(latencies_.point_read) };
+			scoped_perf_context perf{ perf_context() };
+			auto s = db_->Get(rocksdb::ReadOptions{}, default_hanle_, gen_(state->prefix, index), &value);
+			return s.ok();
+		}
+
+		bool get_message(topic_id topic, value_type begin, value_type end, std::string& value)
+		{
+			read_result result;
+			size_t count = 0;
+			value.push_back('[');
+			auto ok = visit_messages(topic, begin, end, [&value, &count](value_type, rocksdb::Slice const& v)
+			{
+				if (count++ > 0)
+					value.push_back(',');
+				value.append(v.data(), v.size());
+				return true;
+			}, result);
+			value.push_back(']');
+			return ok;
+		}
+
+		template <typename Visitor, typename Done = visit_done>
+		bool visit_messages(std::string const& topic, value_type begin, value_type end, Visitor&& visitor,
+			read_result& result, read_limits const& limits = read_limits{}, Done&& done = Done{})
+		{
+			return visit_messages(find_topic(topic), begin, end, std::forward<Visitor>(visitor), result, limits,
+				std::forward<Done>(done));
+		}
+
+		// visitor(index, slice) -> bool, false stops the visit; the slice is only valid during the call.
+		// done() -> bool runs after the last message while the slices are still alive, false fails the visit
+		template <typename Visitor, typename Done = visit_done>
+		bool visit_messages(topic_id topic, value_type begin, value_type end, Visitor&& visitor,
+			read_result& result, read_limits const& limits = read_limits{}, Done&& done = Done{})
+		{
+			// clamp the range to what is committed
+			auto state = topic.state_;
+			if (nullptr != state)
+			{
+				begin = std::max(begin, state->head.load());
+				end = std::min(end, state->tail.load());
+			}
+
+			result = { begin, 0, 0 };
+			if (nullptr == state || begin >= end)
+				return true;
+
+			scoped_latency latency{ timed(latencies_.range_read) };
+			scoped_perf_context perf{ perf_context() };
+			auto tail_key = gen_(state->prefix, end);
+			auto head_key = gen_(state->prefix, begin);
+
+			rocksdb::ReadOptions op;
+			rocksdb::Slice upper_bound = tail_key;
+			op.iterate_upper_bound = &upper_bound;
+			op.pin_data = true;
+
+			auto itr_raw = db_->NewIterator(op, default_hanle_);
+			if (nullptr == itr_raw)
+				return false;
+
+			std::unique_ptr<rocksdb::Iterator> itr{ itr_raw };
+
+			result.next = end;
+			for (itr->Seek(head_key); itr->Valid(); itr->Next())
+			{
+				auto index = queue_key::index_of(itr->key());
+				auto v = itr->value();
+				if (result.messages >= limits.max_messages ||
+					(result.messages > 0 && result.bytes + v.size() > limits.max_bytes))
+				{
+					result.next = index;
+					break;
+				}
+
+				++result.messages;
+				result.bytes += v.size();
+				if (!visitor(index, v))
+				{
+					result.next = index + 1;
+					break;
+				}
+			}
+
+			auto ok = itr->status().ok();
+			return done() && ok;
+		}
+
+#ifndef _WIN32
+		// gather the messages straight from the pinned iterator blocks into fd with writev
+		bool write_messages(topic_id topic, value_type begin, value_type end, int fd,
+			read_result& result, read_limits const& limits = read_limits{})
+		{
+			static constexpr int max_iov = IOV_MAX < 64 ? IOV_MAX : 64;
+			iovec iov[max_iov];
+			int count = 0;
+			bool written = true;
+
+			// pin_data keeps every slice of the iterator valid until it is destroyed
+			auto ok = visit_messages(topic, begin, end, [&](value_type, rocksdb::Slice const& v)
+			{
+				iov[count].iov_base = const_cast<char*>(v.data());
+				iov[count].iov_len = v.size();
+				if (++count == max_iov)
+				{
+					written = write_all(fd, iov, count);
+					count = 0;
+				}
+				return written;
+			}, result, limits, [&]
+			{
+				// the remainder points into the iterator too, write it before the visit releases it
+				if (written && count > 0)
+					written = write_all(fd, iov, count);
+				return written;
+			});
+
+			return ok && written;
+		}
+#endif
+
+		bool poll(std::string const& group, std::string const& topic, size_t max,
+			std::chrono::milliseconds timeout, std::vector<std::string>& messages)
+		{
+			read_limits limits;
+			limits.max_messages = max;
+			read_result result;
+			return poll(group, open_topic(topic), limits, timeout, [&messages](value_type, rocksdb::Slice const& v)
+			{
+				messages.emplace_back(v.data(), v.size());
+				return true;
+			}, result);
+		}
+
+		// deliver the messages behind the committed offset of group, waiting up to timeout
+		// for some to arrive, and commit the new offset once the visitor has seen them
+		template <typename Visitor>
+		bool poll(std::string const& group, topic_id topic, read_limits const& limits,
+			std::chrono::milliseconds timeout, Visitor&& visitor, read_result& result)
+		{
+			scoped_latency latency{ timed(latencies_.poll) };
+			auto& state = *topic.state_;
+			auto& consumer = consumer_group(state, group);
+			std::lock_guard<std::mutex> consumer_lock{ consumer.mutex };
+			if (!load_offset(state, consumer))
+				return false;
+
+			// long poll on the tail
+			auto offset = std::max(consumer.offset, state.head.load());
+			if (state.tail.load() <= offset && timeout.count() > 0)
+			{
+				++state.pollers;
+				std::unique_lock<std::mutex> lock{ state.data_mutex };
+				state.data_cv.wait_for(lock, timeout, [&state, offset] { return state.tail.load() > offset; });
+				--state.pollers;
+			}
+
+			if (!visit_messages(topic, offset, state.tail.load(), std::forward<Visitor>(visitor), result, limits))
+				return false;
+
+			if (result.next == consumer.offset)
+				return true;
+
+			return commit_offset(consumer, result.next, result.messages);
+		}
+
+		// move the committed offset of group, to rewind or to skip messages
+		bool commit_offset(std::string const& group, std::string const& topic, value_type offset)
+		{
+			auto& state = *open_topic(topic).state_;
+			auto& consumer = consumer_group(state, group);
+			std::lock_guard<std::mutex> consumer_lock{ consumer.mutex };
+			return commit_offset(consumer, offset);
+		}
+
+		bool committed_offset(std::string const& group, std::string const& topic, value_type& offset)
+		{
+			auto& state = *open_topic(topic).state_;
+			auto& consumer = consumer_group(state, group);
+			std::lock_guard<std::mutex> consumer_lock{ consumer.mutex };
+			if (!load_offset(state, consumer))
+				return false;
+
+			offset = consumer.offset;
+			return true;
+		}
+
+		void set_retention(std::string const& topic, retention_policy const& policy)
+		{
+			auto& state = *open_topic(topic).state_;
+			std::lock_guard<std::mutex> lock{ state.retention_mutex };
+			state.retention = policy;
+			state.has_retention = true;
+		}
+
+		// drop messages beyond the retention policy of every topic
+		bool enforce_retention()
+		{
+			std::vector<topic_state*> topics;
+			meta_.for_each([&topics](topic_state& state) { topics.push_back(&state); });
+
+			bool ok = true;
+			for (auto state : topics)
+				ok = enforce_retention(*state) && ok;
+			return ok;
+		}
+
+		// advance the head of topic to index and drop everything before it
+		bool truncate(std::string const& topic, value_type index)
+		{
+			auto state = find_topic(topic).state_;
+			if (nullptr == state)
+				return true;
+
+			std::lock_guard<std::mutex> lock{ state->retention_mutex };
+			return truncate(*state, std::min(index, state->tail.load()), 0);
+		}
+
+		bool get_consumer_info(std::string const& group, std::string const& topic, consumer_info& info)
+		{
+			auto& state = *open_topic(topic).state_;
+			auto& consumer = consumer_group(state, group);
+			std::lock_guard<std::mutex> consumer_lock{ consumer.mutex };
+			if (!load_offset(state, consumer))
+				return false;
+
+			if (!stat_counter_t::get(db_, rocksdb::ReadOptions{}, topic_meta_handle_, consumer.delivered_key, info.delivered, 0))
+				return false;
+
+			info.offset = std::max(consumer.offset, state.head.load());
+			info.lag = state.tail.load() - info.offset;
+			return true;
+		}
+
+		// visit [begin, end) of every partition of topic in parallel; visitor(partition, index, slice)
+		// is called from several threads at once, in index order within a partition
+		template <typename Visitor>
+		bool scan_partitions(std::string const& topic, value_type begin, value_type end, Visitor&& visitor,
+			read_limits const& limits = read_limits{})
+		{
+			auto partitions = this->partitions(topic);
+			auto workers = std::min<size_t>(partitions, std::max(1u, std::thread::hardware_concurrency()));
+
+			std::vector<std::future<bool>> scans;
+			for (size_t worker = 0; worker < workers; ++worker)
+			{
+				scans.push_back(std::async(std::launch::async, [&, worker]
+				{
+					bool ok = true;
+					for (auto partition = worker; partition < partitions; partition += workers)
+					{
+						read_result result;
+						ok = visit_messages(find_topic(partition_name(topic, partition)), begin, end,
+							[&visitor, partition](value_type index, rocksdb::Slice const& value)
+						{
+							return visitor(partition, index, value);
+						}, result, limits) && ok;
+					}
+					return ok;
+				}));
+			}
+
+			bool ok = true;
+			for (auto& scan : scans)
+				ok = scan.get() && ok;
+			return ok;
+		}
+
+		bool get_topic_info(std::string const& topic, topic_info& info) const
+		{
+			return get_topic_info(find_topic(topic), info);
+		}
+
+		bool get_topic_info(topic_id topic, topic_info& info) const
+		{
+			auto state = topic.state_;
+			if (nullptr == state)
+				return false;
+
+			info.head = state->head.load();
+			info.tail = state->tail.load();
+			info.count = info.tail - info.head;
+			info.bytes = state->bytes.load();
+			info.conflict_retries = state->conflict_retries.load();
+			info.commit_failures = state->commit_failures.load();
+			return true;
+		}
+
+		// latencies in nanoseconds, per topic counters and, if enabled in the options, rocksdb statistics
+		store_stats stats() const
+		{
+			store_stats s;
+			if (options_.stats.latency)
+			{
+				s.latencies = {
+					{ "append", latencies_.append.snapshot() },
+					{ "append_encode", latencies_.append_encode.snapshot() },
+					{ "append_wait", latencies_.append_wait.snapshot() },
+					{ "append_write", latencies_.append_write.snapshot() },
+					{ "point_read", latencies_.point_read.snapshot() },
+					{ "range_read", latencies_.range_read.snapshot() },
+					{ "poll", latencies_.poll.snapshot() },
+					{ "truncate", latencies_.truncate.snapshot() },
+				};
+			}
+
+			meta_.for_each([&s](topic_state& state)
+			{
+				topic_stats t;
+				t.topic = state.name;
+				t.head = state.head.load();
+				t.tail = state.tail.load();
+				t.bytes = state.bytes.load();
+				t.appended_messages = state.appended_messages.load();
+				t.appended_bytes = state.appended_bytes.load();
+				t.commit_failures = state.commit_failures.load();
+				t.conflict_retries = state.conflict_retries.load();
+				s.topics.push_back(std::move(t));
+			});
+			std::sort(s.topics.begin(), s.topics.end(), [](auto const& lhs, auto const& rhs)
+			{
+				return lhs.topic < rhs.topic;
+			});
+
+			s.counters = {
+				{ "conflict_retries", conflict_retries_.load() },
+				{ "retries_exhausted", retries_exhausted_.load() },
+			};
+
+			if (statistics_)
+				statistics_->getTickerMap(&s.rocksdb_tickers);
+			if (options_.stats.perf_context)
+				s.perf_context = perf_totals_.snapshot();
+			return s;
+		}
+
+	private:
+		struct latencies
+		{
+			latency_histogram		append;
+			latency_histogram		append_encode;		// index allocation, keys and batch
+			latency_histogram		append_wait;		// for the earlier appends of the topic to commit
+			latency_histogram		append_write;		// WAL and memtables
+			latency_histogram		point_read;
+			latency_histogram		range_read;
+			latency_histogram		poll;				// long polling included
+			latency_histogram		truncate;
+		};
+
+		struct identity
+		{
+			template <typename T>
+			T const& operator() (T const& value) const noexcept
+			{
+				return value;
+			}
+		};
+
+#ifndef _WIN32
+		static bool write_all(int fd, iovec* iov, int count)
+		{
+			while (count > 0)
+			{
+				auto n = ::writev(fd, iov, count);
+				if (n < 0)
+				{
+					if (EINTR == errno)
+						continue;
+					return false;
+				}
+
+				// skip what was written, resume inside a partially written buffer
+				auto written = static_cast<size_t>(n);
+				while (count > 0 && written >= iov->iov_len)
+				{
+					written -= iov->iov_len;
+					++iov;
+					--count;
+				}
+
+				if (count > 0)
+				{
+					iov->iov_base = static_cast<char*>(iov->iov_base) + written;
+					iov->iov_len -= written;
+				}
+			}
+			return true;
+		}
+#endif
+
+		static std::string const& partitions_suffix()
+		{
+			static std::string const suffix = "_partitions";
+			return suffix;
+		}
+
+		// no topic meta key begins with a nul
+		static std::string const& format_key()
+		{
+			static std::string const key{ "\0format_version", 15 };
+			return key;
+		}
+
+		latency_histogram* timed(latency_histogram& histogram)
+		{
+			return options_.stats.latency ? &histogram : nullptr;
+		}
+
+		perf_totals* perf_context()
+		{
+			return options_.stats.perf_context ? &perf_totals_ : nullptr;
+		}
+
+		// lookup only, reads never create topics
+		topic_id find_topic(std::string const& topic) const
+		{
+			return topic_id{ meta_.find(topic) };
+		}
+
+		// write [first, last) behind the tail of topic in one batch
+		template <typename Iterator, typename Projection>
+		bool append(topic_state& state, Iterator first, Iterator last, Projection proj, index_range& range)
+		{
+			scoped_latency latency{ timed(latencies_.append) };
+			scoped_perf_context perf{ perf_context() };
+
+			rocksdb::WriteBatch batch;
+			value_type count = 0, index = 0, next = 0;
+			uint64_t bytes = 0;
+			{
+				scoped_latency encode_latency{ timed(latencies_.append_encode) };
+
+				// allocate the indexes
+				count = static_cast<value_type>(std::distance(first, last));
+				index = state.next.fetch_add(count);
+				next = index + count;
+
+				// enqueue
+				for (auto i = index; first != last; ++first, ++i)
+				{
+					rocksdb::Slice value = proj(*first);
+					batch.Put(default_hanle_, gen_(state.prefix, i), value);
+					bytes += value.size();
+				}
+
+				// sparse time index, one entry per batch with its byte total, for retention
+				batch.Put(topic_time_handle_, gen_(state.prefix, index), time_value(now_ms(), bytes));
+
+				// the byte total is a merged counter, it needs no ordering
+				stat_counter_t::fetch_add(&batch, topic_meta_handle_, state.bytes_key, bytes);
+			}
+
+			// wait until every earlier append of this topic is done, so the persisted tail only grows;
+			// a single writer is always next in line
+			std::unique_lock<std::mutex> lock{ state.commit_mutex, std::defer_lock };
+			if (queue_engine::single_writer != options_.engine)
+			{
+				scoped_latency wait_latency{ timed(latencies_.append_wait) };
+				lock.lock();
+				state.commit_cv.wait(lock, [&state, index] { return state.turn.load() == index; });
+				lock.unlock();
+			}
+			assert(state.turn.load() == index);
+
+			// the turn is held by the counter, not the mutex, later appends wait on the condition meanwhile;
+			// behind a failed append the indexes no longer follow the tail, writing them would leave a gap
+			auto committed = false;
+			if (state.tail.load() == index)
+			{
+				scoped_latency write_latency{ timed(latencies_.append_write) };
+				queue_counter_t::put(&batch, topic_meta_handle_, state.tail_key, next);
+				committed = write(batch, &state).ok();
+			}
+			if (queue_engine::single_writer != options_.engine)
+				lock.lock();
+
+			if (committed)
+			{
+				state.bytes.fetch_add(bytes);
+				state.appended_messages.fetch_add(count, std::memory_order_relaxed);
+				state.appended_bytes.fetch_add(bytes, std::memory_order_relaxed);
+				state.tail.store(next);
+				state.turn.store(next);
+			}
+			else
+			{
+				// the appends handed out behind this one fail in turn, the last of them takes the
+				// indexes back to the tail so the next append starts there
+				state.commit_failures.fetch_add(1, std::memory_order_relaxed);
+				auto handed_out = next;
+				auto tail = state.tail.load();
+				state.turn.store(state.next.compare_exchange_strong(handed_out, tail) ? tail : next);
+			}
+			if (lock.owns_lock())
+			{
+				lock.unlock();
+				state.commit_cv.notify_all();
+			}
+
+			// wake long polling consumers
+			if (committed && state.pollers.load() > 0)
+			{
+				{
+					std::lock_guard<std::mutex> data_lock{ state.data_mutex };
+				}
+				state.data_cv.notify_all();
+			}
+
+			if (!committed)
+				return false;
+
+			range = { index, next };
+			return true;
+		}
+
+		// every write is serialized by the meta table, no need for the lock manager; stalls refused
+		// by no_slowdown are retried with jittered exponential backoff and counted on state
+		rocksdb::Status write(rocksdb::WriteBatch& batch, topic_state* state = nullptr)
+		{
+			rocksdb::TransactionDBWriteOptimizations optimizations;
+			optimizations.skip_concurrency_control = true;
+
+			auto const& contention = options_.contention;
+			auto backoff = contention.initial_backoff;
+			for (size_t retries = 0; ; ++retries)
+			{
+				auto s = txn_db_ ? txn_db_->Write(write_options_, optimizations, &batch) : db_->Write(write_options_, &batch);
+				if (!is_retryable(s))
+					return s;
+
+				if (retries >= contention.max_retries)
+				{
+					retries_exhausted_.fetch_add(1, std::memory_order_relaxed);
+					return s;
+				}
+
+				conflict_retries_.fetch_add(1, std::memory_order_relaxed);
+				if (state)
+					state->conflict_retries.fetch_add(1, std::memory_order_relaxed);
+
+				std::this_thread::sleep_for(jittered(backoff));
+				backoff = std::min(backoff * 2, contention.max_backoff);
+			}
+		}
+
+		bool is_retryable(rocksdb::Status const& s) const
+		{
+			// Incomplete is a stall refused by no_slowdown, nothing else comes back from a plain write
+			// that another try would fix
+			return options_.contention.retry_write_stalls && s.IsIncomplete();
+		}
+
+		// equal jitter: half the backoff plus a random part of the other half, so racing writers spread out
+		static std::chrono::microseconds jittered(std::chrono::microseconds backoff)
+		{
+			thread_local std::minstd_rand engine{ std::random_device{}() };
+			auto half = backoff.count() / 2;
+			std::uniform_int_distribution<decltype(half)> jitter{ 0, half };
+			return std::chrono::microseconds{ backoff.count() - half + jitter(engine) };
+		}
+
+		consumer_group_state& consumer_group(topic_state& state, std::string const& group)
+		{
+			std::lock_guard<std::mutex> lock{ state.groups_mutex };
+			auto& consumer = state.groups[group];
+			if (!consumer)
+				consumer = std::make_unique<consumer_group_state>(group, state.name);
+			return *consumer;
+		}
+
+		// consumer.mutex is held
+		bool load_offset(topic_state& state, consumer_group_state& consumer)
+		{
+			if (consumer.loaded)
+				return true;
+
+			if (!queue_counter_t::get(db_, rocksdb::ReadOptions{}, topic_meta_handle_, consumer.offset_key, consumer.offset))
+				return false;
+
+			consumer.offset = std::max(consumer.offset, state.head.load());
+			consumer.loaded = true;
+			return true;
+		}
+
+		// consumer.mutex is held
+		bool commit_offset(consumer_group_state& consumer, value_type offset, counter_type delivered = 0)
+		{
+			rocksdb::WriteBatch batch;
+			if (!queue_counter_t::put(&batch, topic_meta_handle_, consumer.offset_key, offset))
+				return false;
+			if (delivered > 0 && !stat_counter_t::fetch_add(&batch, topic_meta_handle_, consumer.delivered_key, delivered))
+				return false;
+
+			if (!write(batch).ok())
+				return false;
+
+			consumer.offset = offset;
+			consumer.loaded = true;
+			return true;
+		}
+
+		static uint64_t now_ms()
+		{
+			using namespace std::chrono;
+			return duration_cast<milliseconds>(system_clock::now().time_since_epoch()).count();
+		}
+
+		bool enforce_retention(topic_state& state)
+		{
+			std::lock_guard<std::mutex> lock{ state.retention_mutex };
+			auto const& policy = state.has_retention ? state.retention : options_.retention.default_policy;
+
+			auto head = state.head.load();
+			auto tail = state.tail.load();
+			auto new_head = head;
+
+			if (policy.max_messages > 0 && tail - head > policy.max_messages)
+				new_head = static_cast<value_type>(tail - policy.max_messages);
+
+			if (policy.max_age.count() > 0)
+			{
+				auto cutoff = now_ms() - std::chrono::duration_cast<std::chrono::milliseconds>(policy.max_age).count();
+				value_type expired;
+				if (!expired_before(state, head, tail, cutoff, expired))
+					return false;
+				new_head = std::max(new_head, expired);
+			}
+
+			return truncate(state, new_head, policy.max_bytes);
+		}
+
+		// one append as the time index has it: [begin, end) appended at time with bytes in total;
+		// entries of older versions have no total, messages below the first entry neither
+		struct time_entry
+		{
+			value_type				begin = 0;
+			value_type				end = 0;
+			bool					timed = false;
+			uint64_t				time = 0;
+			bool					sized = false;
+			uint64_t				bytes = 0;
+		};
+
+		static std::string time_value(uint64_t time, uint64_t bytes)
+		{
+			std::string value;
+			value.reserve(2 * sizeof(uint64_t));
+			put_fixed_64(&value, time);
+			put_fixed_64(&value, bytes);
+			return value;
+		}
+
+		// visitor(entry) -> bool gets the appends of [head, tail) in order, false stops
+		template <typename Visitor>
+		bool visit_appends(topic_state& state, value_type head, value_type tail, Visitor&& visitor)
+		{
+			auto head_key = gen_(state.prefix, head);
+			auto tail_key = gen_(state.prefix, tail);
+
+			rocksdb::ReadOptions op;
+			rocksdb::Slice upper_bound = tail_key;
+			op.iterate_upper_bound = &upper_bound;
+			std::unique_ptr<rocksdb::Iterator> itr{ db_->NewIterator(op, topic_time_handle_) };
+
+			time_entry entry;
+			entry.begin = head;
+			for (itr->Seek(head_key); itr->Valid(); itr->Next())
+			{
+				if (itr->key().size() != queue_key::static_size)
+					continue;
+
+				// the entry before ends where this one begins
+				auto index = queue_key::index_of(itr->key());
+				if (index > entry.begin)
+				{
+					entry.end = index;
+					if (!visitor(entry))
+						return true;
+				}
+
+				auto value = itr->value();
+				entry = time_entry{};
+				entry.begin = index;
+				entry.timed = value.size() >= sizeof(uint64_t);
+				entry.time = entry.timed ? decode_fixed_64(value.data()) : 0;
+				entry.sized = value.size() >= 2 * sizeof(uint64_t);
+				entry.bytes = entry.sized ? decode_fixed_64(value.data() + sizeof(uint64_t)) : 0;
+			}
+			if (!itr->status().ok())
+				return false;
+
+			if (entry.begin < tail)
+			{
+				entry.end = tail;
+				visitor(entry);
+			}
+			return true;
+		}
+
+		// the first index of [head, tail) appended at or after cutoff; messages without a time are
+		// older than the entry after them
+		bool expired_before(topic_state& state, value_type head, value_type tail, uint64_t cutoff, value_type& index)
+		{
+			index = head;
+			return visit_appends(state, head, tail, [&index, cutoff](time_entry const& entry)
+			{
+				if (!entry.timed)
+					return true;
+				if (entry.time >= cutoff)
+					return false;
+
+				index = entry.end;
+				return true;
+			});
+		}
+
+		// state.retention_mutex is held; drop [head, new_head), and more while the topic is over max_bytes.
+		// whole appends are sized by their totals, only an append cut in two is read, and it keeps
+		// a time entry at the new head so its messages keep their age
+		bool truncate(topic_state& state, value_type new_head, uint64_t max_bytes)
+		{
+			scoped_latency latency{ timed(latencies_.truncate) };
+			auto head = state.head.load();
+			auto tail = state.tail.load();
+			if (new_head <= head && 0 == max_bytes)
+				return true;
+
+			uint64_t removed = 0;
+			auto const bytes = state.bytes.load();
+			auto over_budget = [&](uint64_t more)
+			{
+				return max_bytes > 0 && bytes - removed > max_bytes + more;
+			};
+
+			bool failed = false;
+			time_entry split;
+			auto ok = visit_appends(state, head, tail, [&](time_entry const& entry)
+			{
+				if (entry.begin >= new_head && !over_budget(0))
+					return false;
+
+				if (entry.sized && (entry.end <= new_head || over_budget(entry.bytes)))
+				{
+					removed += entry.bytes;
+					new_head = std::max(new_head, entry.end);
+					return true;
+				}
+
+				// message by message
+				auto begin_key = gen_(state.prefix, entry.begin);
+				auto end_key = gen_(state.prefix, entry.end);
+				rocksdb::ReadOptions op;
+				rocksdb::Slice upper_bound = end_key;
+				op.iterate_upper_bound = &upper_bound;
+				std::unique_ptr<rocksdb::Iterator> itr{ db_->NewIterator(op, default_hanle_) };
+
+				uint64_t entry_removed = 0;
+				bool stopped = false;
+				for (itr->Seek(begin_key); itr->Valid(); itr->Next())
+				{
+					auto index = queue_key::index_of(itr->key());
+					stopped = index >= new_head && !over_budget(0);
+					if (stopped)
+						break;
+
+					removed += itr->value().size();
+					entry_removed += itr->value().size();
+					new_head = std::max(new_head, index + 1);
+				}
+				if (!itr->status().ok())
+				{
+					failed = true;
+					return false;
+				}
+
+				if (!stopped || new_head >= entry.end)
+				{
+					new_head = std::max(new_head, entry.end);
+					return true;
+				}
+
+				split = entry;
+				split.begin = new_head;
+				split.bytes -= std::min(split.bytes, entry_removed);
+				return false;
+			});
+
+			if (!ok || failed)
+				return false;
+			if (new_head <= head)
+				return true;
+
+			// one range tombstone per column family instead of one per message
+			auto head_key = gen_(state.prefix, head);
+			auto new_head_key = gen_(state.prefix, new_head);
+			rocksdb::WriteBatch batch;
+			batch.DeleteRange(default_hanle_, head_key, new_head_key);
+			batch.DeleteRange(topic_time_handle_, head_key, new_head_key);
+			if (split.timed && split.begin == new_head)
+			{
+				std::string value;
+				put_fixed_64(&value, split.time);
+				if (split.sized)
+					put_fixed_64(&value, split.bytes);
+				batch.Put(topic_time_handle_, new_head_key, value);
+			}
+			queue_counter_t::put(&batch, topic_meta_handle_, state.head_key, new_head);
+			stat_counter_t::fetch_add(&batch, topic_meta_handle_, state.bytes_key, counter_type{ 0 } - removed);
+
+			if (!write(batch, &state).ok())
+				return false;
+
+			state.bytes.fetch_sub(removed);
+			state.head.store(new_head);
+			retention_filter_.set_head(state.prefix, new_head);
+			return true;
+		}
+
+		void retention_loop()
+		{
+			std::unique_lock<std::mutex> lock{ retention_wait_mutex_ };
+			while (!retention_cv_.wait_for(lock, options_.retention.check_interval, [this] { return retention_stopping_; }))
+			{
+				lock.unlock();
+				enforce_retention();
+				lock.lock();
+			}
+		}
+
+		void load_meta()
+		{
+			static std::string const head_suffix = "_head";
+			static std::string const tail_suffix = "_tail";
+			static std::string const bytes_suffix = "_bytes";
+
+			auto ends_with = [](rocksdb::Slice key, std::string const& suffix)
+			{
+				return key.size() > suffix.size() &&
+					0 == std::memcmp(key.data() + key.size() - suffix.size(), suffix.data(), suffix.size());
+			};
+
+			std::unique_ptr<rocksdb::Iterator> itr{ db_->NewIterator(rocksdb::ReadOptions{}, topic_meta_handle_) };
+			for (itr->SeekToFirst(); itr->Valid(); itr->Next())
+			{
+				auto key = itr->key();
+				auto value = itr->value();
+				if (ends_with(key, tail_suffix) && value.size() == sizeof(value_type))
+				{
+					auto& state = meta_.get_or_create(std::string{ key.data(), key.size() - tail_suffix.size() }, gen_);
+					state.tail = state.next = state.turn = rocksdb_ingtegral_tratis<value_type>::decode(value.data());
+				}
+				else if (ends_with(key, head_suffix) && value.size() == sizeof(value_type))
+				{
+					auto& state = meta_.get_or_create(std::string{ key.data(), key.size() - head_suffix.size() }, gen_);
+					state.head = rocksdb_ingtegral_tratis<value_type>::decode(value.data());
+					retention_filter_.set_head(state.prefix, state.head.load());
+				}
+				else if (ends_with(key, bytes_suffix) && value.size() == sizeof(uint64_t))
+				{
+					auto& state = meta_.get_or_create(std::string{ key.data(), key.size() - bytes_suffix.size() }, gen_);
+					state.bytes = decode_fixed_64(value.data());
+				}
+				else if (ends_with(key, partitions_suffix()) && value.size() == sizeof(uint64_t))
+				{
+					auto& state = meta_.get_or_create(std::string{ key.data(), key.size() - partitions_suffix().size() }, gen_);
+					state.partitions = static_cast<size_t>(decode_fixed_64(value.data()));
+				}
+			}
+
+			if (!itr->status().ok())
+				throw std::runtime_error{ itr->status().getState() };
+		}
+
+		// a db of a newer layout is refused rather than misread; topics without a version
+		// were written with 32-bit indexes and are migrated first
+		void check_format()
+		{
+			std::string value;
+			auto s = db_->Get(rocksdb::ReadOptions{}, topic_meta_handle_, format_key(), &value);
+			if (s.ok())
+			{
+				if (value.size() != sizeof(uint64_t) || decode_fixed_64(value.data()) != format_version)
+					throw std::runtime_error{ "Queue format is not supported." };
+				return;
+			}
+			if (!s.IsNotFound())
+				throw std::runtime_error{ s.getState() };
+
+			migrate_format();
+		}
+
+		// rewrites the 32-bit layout in place: 20 bytes message keys become 24 bytes ones, 4 bytes
+		// head and tail counters 8 bytes ones, and every topic gets its byte total and a time entry
+		// at its first message, which starts its age from now; each step is safe to run again after
+		// a crash, the version is written last
+		void migrate_format()
+		{
+			using uuid_t = boost::uuids::uuid;
+			static constexpr size_t old_key_size = uuid_t::static_size() + sizeof(uint32_t);
+			static constexpr size_t max_batch_bytes = 4 << 20;
+
+			struct topic_totals
+			{
+				uint64_t				bytes = 0;
+				value_type				first = std::numeric_limits<value_type>::max();
+			};
+			std::unordered_map<uuid_t, topic_totals, boost::hash<uuid_t>> totals;
+
+			rocksdb::WriteBatch batch;
+			auto flush = [this, &batch]
+			{
+				auto s = db_->Write(write_options_, &batch);
+				if (!s.ok())
+					throw std::runtime_error{ s.getState() };
+				batch.Clear();
+			};
+
+			// the iterator reads from its own snapshot, the keys written meanwhile do not show up
+			std::unique_ptr<rocksdb::Iterator> itr{ db_->NewIterator(rocksdb::ReadOptions{}, default_hanle_) };
+			for (itr->SeekToFirst(); itr->Valid(); itr->Next())
+			{
+				auto key = itr->key();
+				if (key.size() != old_key_size && key.size() != queue_key::static_size)
+					continue;
+
+				uuid_t prefix;
+				std::memcpy(prefix.data, key.data(), uuid_t::static_size());
+				value_type index = 0;
+				if (key.size() == queue_key::static_size)
+				{
+					index = queue_key::index_of(key);
+				}
+				else
+				{
+					// big endian 32-bit index
+					auto p = reinterpret_cast<unsigned char const*>(key.data() + uuid_t::static_size());
+					index = uint32_t{ p[0] } << 24 | uint32_t{ p[1] } << 16 | uint32_t{ p[2] } << 8 | p[3];
+					batch.Put(default_hanle_, gen_(prefix, index), itr->value());
+					batch.Delete(default_hanle_, key);
+					if (batch.GetDataSize() >= max_batch_bytes)
+						flush();
+				}
+
+				auto& topic = totals[prefix];
+				topic.bytes += itr->value().size();
+				topic.first = std::min(topic.first, index);
+			}
+			if (!itr->status().ok())
+				throw std::runtime_error{ itr->status().getState() };
+			flush();
+
+			// counters, totals and time entries of every topic, and the version, in one batch
+			static std::string const head_suffix = "_head";
+			static std::string const tail_suffix = "_tail";
+			auto ends_with = [](rocksdb::Slice key, std::string const& suffix)
+			{
+				return key.size() > suffix.size() &&
+					0 == std::memcmp(key.data() + key.size() - suffix.size(), suffix.data(), suffix.size());
+			};
+
+			auto const now = now_ms();
+			itr.reset(db_->NewIterator(rocksdb::ReadOptions{}, topic_meta_handle_));
+			for (itr->SeekToFirst(); itr->Valid(); itr->Next())
+			{
+				auto key = itr->key();
+				auto value = itr->value();
+				auto is_tail = ends_with(key, tail_suffix);
+				if (!is_tail && !ends_with(key, head_suffix))
+					continue;
+
+				if (value.size() == sizeof(uint32_t))
+					queue_counter_t::put(&batch, topic_meta_handle_, key.ToString(), decode_fixed_32(value.data()));
+
+				// every topic with messages has a tail
+				if (!is_tail)
+					continue;
+
+				auto name = std::string{ key.data(), key.size() - tail_suffix.size() };
+				auto totals_itr = totals.find(gen_.prefix(name));
+				if (totals.end() == totals_itr)
+					continue;
+
+				auto const& topic = totals_itr->second;
+				stat_counter_t::put(&batch, topic_meta_handle_, name + "_bytes", topic.bytes);
+
+				std::string time;
+				auto time_key = gen_(totals_itr->first, topic.first);
+				auto s = db_->Get(rocksdb::ReadOptions{}, topic_time_handle_, time_key, &time);
+				if (s.IsNotFound())
+				{
+					batch.Put(topic_time_handle_, time_key, time_value(now, topic.bytes));
+				}
+				else if (!s.ok())
+				{
+					throw std::runtime_error{ s.getState() };
+				}
+			}
+			if (!itr->status().ok())
+				throw std::runtime_error{ itr->status().getState() };
+
+			std::string version;
+			put_fixed_64(&version, format_version);
+			batch.Put(topic_meta_handle_, format_key(), version);
+			flush();
+		}
+
+		// plain engines: move every tail up to the last message of its topic, the persisted tail is a lower bound
+		void recover_tails()
+		{
+			std::vector<topic_state*> topics;
+			meta_.for_each([&topics](topic_state& state) { topics.push_back(&state); });
+
+			for (auto state : topics)
+			{
+				auto first_key = gen_(state->prefix, 0);
+				auto last_key = gen_(state->prefix, std::numeric_limits<value_type>::max());
+
+				rocksdb::ReadOptions op;
+				rocksdb::Slice lower_bound = first_key;
+				op.iterate_lower_bound = &lower_bound;
+				std::unique_ptr<rocksdb::Iterator> itr{ db_->NewIterator(op, default_hanle_) };
+
+				itr->SeekForPrev(last_key);
+				if (!itr->status().ok())
+					throw std::runtime_error{ itr->status().getState() };
+				if (!itr->Valid())
+					continue;
+				if (itr->key().size() != queue_key::static_size)
+					throw std::runtime_error{ "Corrupted queue key of topic " + state->name };
+
+				auto tail = queue_key::index_of(itr->key()) + 1;
+				if (tail > state->tail.load())
+					state->tail = state->next = state->turn = tail;
+			}
+		}
+
+		void commit_loop()
+		{
+			auto const& gc = options_.group_commit;
+			std::unique_lock<std::mutex> lock{ staging_mutex_ };
+			for (;;)
+			{
+				staging_cv_.wait(lock, [this] { return stopping_ || staged_count_ > 0; });
+				if (0 == staged_count_)
+					return;
+
+				// linger a while for a fuller batch
+				if (!stopping_ && staged_count_ < gc.max_batch_size)
+				{
+					staging_cv_.wait_for(lock, gc.max_linger, [this, &gc]
+					{
+						return stopping_ || staged_count_ >= gc.max_batch_size;
+					});
+				}
+
+				staging_t staging;
+				staging.swap(staging_);
+				staged_count_ = 0;
+				lock.unlock();
+
+				for (auto& topic : staging)
+					flush_topic(*topic.first, topic.second);
+
+				lock.lock();
+			}
+		}
+
+		void flush_topic(topic_state& state, std::vector<pending_message>& messages)
+		{
+			auto const batch_size = std::max<size_t>(options_.group_commit.max_batch_size, 1);
+			auto first = messages.begin();
+			while (messages.end() != first)
+			{
+				auto count = std::min<size_t>(batch_size, std::distance(first, messages.end()));
+				auto last = first + count;
+
+				index_range range;
+				auto ok = append(state, first, last, [](auto const& m) -> auto const& { return m.value; }, range);
+
+				for (auto index = range.begin; first != last; ++first, ++index)
+				{
+					if (first->callback)
+						first->callback(ok, index);
+				}
+			}
+		}
+
+		void init(std::string const& path)
+		{
+			init_db(path);
+			open_db(path);
+			check_format();
+			load_meta();
+
+			if (queue_engine::transactional != options_.engine)
+				recover_tails();
+		}
+
+		void init_db(std::string const& path)
+		{
+			using namespace rocksdb;
+			Status s;
+
+			DBOptions op;
+			op.create_if_missing = true;
+
+			// check db
+			std::vector<std::string> column_families;
+			DB::ListColumnFamilies(op, path, &column_families);
+			auto is_to_create_topic_meta_column_family =
+				std::find(column_families.begin(), column_families.end(),
+					topic_meta_column_family_name_) == column_families.end();
+
+			normal_db_t db;
+			if (is_to_create_topic_meta_column_family)
+			{
+				DB* db_raw = nullptr;
+				Options option;
+				option.create_if_missing = true;
+				s = DB::Open(option, path, &db_raw);
+				if (Status::OK() != s)
+				{
+					assert(nullptr == db_raw);
+					throw std::runtime_error{ s.getState() };
+				}
+
+				assert(db_raw);
+				db.reset(db_raw);
+				ColumnFamilyHandle* handle_raw = nullptr;
+				s = db->CreateColumnFamily(ColumnFamilyOptions{},
+					topic_meta_column_family_name_, &handle_raw);
+				if (Status::OK() != s)
+				{
+					assert(nullptr == handle_raw);
+					throw std::runtime_error{ s.getState() };
+				}
+
+				assert(handle_raw);
+				db->DestroyColumnFamilyHandle(handle_raw);
+			}
+		}
+
+		void tune(rocksdb::ColumnFamilyOptions& queue_op, rocksdb::ColumnFamilyOptions& meta_op) const
+		{
+			using namespace rocksdb;
+			auto const& tuning = options_.tuning;
+
+			// queue keys: prefix bloom on the 16 bytes topic uuid, every read stays inside one prefix
+			BlockBasedTableOptions queue_table;
+			queue_table.block_cache = NewLRUCache(tuning.queue_block_cache_size);
+			queue_table.filter_policy.reset(NewBloomFilterPolicy(tuning.bloom_bits_per_key, false));
+			queue_table.whole_key_filtering = false;
+
+			queue_op.prefix_extractor.reset(NewFixedPrefixTransform(boost::uuids::uuid::static_size()));
+			queue_op.memtable_prefix_bloom_size_ratio = 0.1;
+			queue_op.table_factory.reset(NewBlockBasedTableFactory(queue_table));
+
+			switch (tuning.compaction_style)
+			{
+			case queue_compaction_style::level:
+				queue_op.OptimizeLevelStyleCompaction(tuning.write_buffer_size * 8);
+				break;
+			case queue_compaction_style::universal:
+				queue_op.OptimizeUniversalStyleCompaction(tuning.write_buffer_size * 8);
+				break;
+			}
+			queue_op.write_buffer_size = tuning.write_buffer_size;
+
+			// topic meta: small and hot, point lookups only
+			BlockBasedTableOptions meta_table;
+			meta_table.block_cache = NewLRUCache(tuning.meta_block_cache_size);
+			meta_table.filter_policy.reset(NewBloomFilterPolicy(tuning.bloom_bits_per_key, false));
+			meta_table.cache_index_and_filter_blocks = true;
+			meta_table.pin_l0_filter_and_index_blocks_in_cache = true;
+			meta_op.table_factory.reset(NewBlockBasedTableFactory(meta_table));
+		}
+
+		void open_db(std::string const& path)
+		{
+			using namespace rocksdb;
+			Status s;
+
+			Options op;
+			op.IncreaseParallelism(std::thread::hardware_concurrency());
+			op.OptimizeLevelStyleCompaction();
+			op.create_if_missing = true;
+			op.create_missing_column_families = true;
+
+			TransactionDBOptions txn_op;
+
+			if (options_.stats.rocksdb_statistics)
+			{
+				statistics_ = CreateDBStatistics();
+				op.statistics = statistics_;
+			}
+
+			ColumnFamilyOptions queue_op;
+			ColumnFamilyOptions meta_op;
+			if (options_.tuning.enabled)
+				tune(queue_op, meta_op);
+
+			// the messages and their time index are truncated by retention
+			queue_op.compaction_filter = &retention_filter_;
+
+			// byte totals and consumer statistics are merged, not read-modify-written
+			meta_op.merge_operator = std::make_shared<counter_merge_operator>();
+			meta_op.max_successive_merges = 5;
+
+			// open DB with three column families
+			std::vector<rocksdb::ColumnFamilyDescriptor> column_families;
+			// have to open default column family
+			column_families.push_back(ColumnFamilyDescriptor(
+				kDefaultColumnFamilyName, queue_op));
+			// open the new ones, too
+			column_families.push_back(ColumnFamilyDescriptor(
+				topic_meta_column_family_name_, meta_op));
+			column_families.push_back(ColumnFamilyDescriptor(
+				topic_time_column_family_name_, queue_op));
+			std::vector<ColumnFamilyHandle*> raw_handles;
+
+			DB* db_raw = nullptr;
+			TransactionDB* txn_db_raw = nullptr;
+			if (queue_engine::transactional == options_.engine)
+			{
+				s = TransactionDB::Open(op, txn_op, path, column_families, &raw_handles, &txn_db_raw);
+				db_raw = txn_db_raw;
+			}
+			else
+			{
+				s = DB::Open(op, path, column_families, &raw_handles, &db_raw);
+			}
+
+			if (Status::OK() != s)
+			{
+				assert(nullptr == db_raw);
+				throw std::runtime_error{ s.getState() };
+			}
+			assert(db_raw);
+
+			// cache db and handles with raii for exceptional safty
+			normal_db_t db{ db_raw };
+
+			auto find_handle = [&raw_handles](std::string const& name)
+			{
+				auto itr = std::find_if(raw_handles.begin(), raw_handles.end(),
+					[&name](auto const& handle)
+				{
+					return handle->GetName() == name;
+				});
+
+				if (raw_handles.end() == itr)
+				{
+					throw std::runtime_error{ "Rocksdb status is not inconsistence." };
+				}
+
+				return *itr;
+			};
+
+			write_options_.sync = wal_sync_policy::sync == options_.tuning.wal;
+			write_options_.disableWAL = wal_sync_policy::disabled == options_.tuning.wal;
+			write_options_.no_slowdown = options_.contention.retry_write_stalls;
+
+			default_hanle_ = raw_handles[0];
+			topic_meta_handle_ = find_handle(topic_meta_column_family_name_);
+			topic_time_handle_ = find_handle(topic_time_column_family_name_);
+			handles_ = std::move(raw_handles);
+			db_ = std::move(db);
+			txn_db_ = txn_db_raw;
 		}
 
 	private:
-		transaction_db_t				db_;
+		queue_store_options const		options_;
+		partitioner_t					partitioner_ = options_.partitioner ? options_.partitioner : default_partitioner{};
+		std::mutex						partitions_mutex_;
+		retention_filter				retention_filter_;		// outlives db_
+		normal_db_t						db_;
+		rocksdb::TransactionDB*			txn_db_ = nullptr;		// db_ of the transactional engine
 		queue_generator const			gen_;
+		topic_meta_table				meta_;
 		std::string const				topic_meta_column_family_name_ = "topic_meta";
+		std::string const				topic_time_column_family_name_ = "topic_time";
 		column_family_handles_t		handles_;
+		rocksdb::WriteOptions			write_options_;
 		rocksdb::ColumnFamilyHandle*	topic_meta_handle_ = nullptr;
+		rocksdb::ColumnFamilyHandle*	topic_time_handle_ = nullptr;
 		rocksdb::ColumnFamilyHandle*	default_hanle_ = nullptr;
+
+		// statistics
+		latencies						latencies_;
+		perf_totals						perf_totals_;
+		std::shared_ptr<rocksdb::Statistics>	statistics_;
+		std::atomic<uint64_t>			conflict_retries_{ 0 };
+		std::atomic<uint64_t>			retries_exhausted_{ 0 };
+
+		// group commit
+		std::mutex						staging_mutex_;
+		std::condition_variable			staging_cv_;
+		staging_t						staging_;
+		size_t							staged_count_ = 0;
+		bool							stopping_ = false;
+		std::thread						committer_;
+
+		// retention
+		std::mutex						retention_wait_mutex_;
+		std::condition_variable			retention_cv_;
+		bool							retention_stopping_ = false;
+		std::thread						retention_thread_;
 	};
 }
 
@@ -0,0 +1,380 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <filesystem>
+#include "file_store.hpp"
+#include "queue_store.hpp"
+
+// ./store_bench.exe [db-dir] [messages-per-producer] [message-size]
+// prints one JSON document with every result, databases live in db-dir/timax_store_bench (db-dir defaults to the temp directory)
+size_t const store_bench_dir_index = 1;
+size_t const store_bench_messages_index = 2;
+size_t const store_bench_size_index = 3;
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_config
+{
+	std::string		dir;
+	size_t			messages = 100000;
+	size_t			message_size = 256;
+};
+
+/* latency samples in microseconds */
+class latency_samples
+{
+public:
+	void add(bench_clock::duration d)
+	{
+		samples_.push_back(std::chrono::duration<double, std::micro>(d).count());
+	}
+
+	// {"p50":..,"p90":..,"p99":..,"max":..}
+	std::string to_json()
+	{
+		std::sort(samples_.begin(), samples_.end());
+		std::ostringstream os;
+		os << "{\"count\":" << samples_.size()
+			<< ",\"p50\":" << percentile(0.50)
+			<< ",\"p90\":" << percentile(0.90)
+			<< ",\"p99\":" << percentile(0.99)
+			<< ",\"max\":" << (samples_.empty() ? 0.0 : samples_.back()) << "}";
+		return os.str();
+	}
+
+private:
+	double percentile(double p) const
+	{
+		if (samples_.empty())
+			return 0.0;
+		return samples_[std::min(samples_.size() - 1, static_cast<size_t>(p * samples_.size()))];
+	}
+
+private:
+	std::vector<double>		samples_;
+};
+
+std::string fresh_dir(bench_config const& config, std::string const& name)
+{
+	auto path = config.dir + "/" + name;
+	std::filesystem::remove_all(path);
+	return path;
+}
+
+double seconds_since(bench_clock::time_point begin)
+{
+	return std::chrono::duration<double>(bench_clock::now() - begin).count();
+}
+
+// every producer owns a topic and appends one message at a time
+std::string bench_push_back(bench_config const& config, char const* profile,
+	timax::queue_store_options const& options, size_t producers)
+{
+	timax::queue_store store{ fresh_dir(config, std::string{ "push_" } + profile + "_" + std::to_string(producers)), options };
+	std::string const value(config.message_size, 'x');
+	auto per_producer = config.messages / producers;
+
+	auto begin = bench_clock::now();
+	std::vector<std::thread> threads;
+	for (size_t p = 0; p < producers; ++p)
+	{
+		threads.emplace_back([&store, &value, per_producer, p]
+		{
+			auto topic = store.open_topic("bench_" + std::to_string(p));
+			for (size_t i = 0; i < per_producer; ++i)
+				store.push_back(topic, value);
+		});
+	}
+	for (auto& t : threads)
+		t.join();
+	auto elapsed = seconds_since(begin);
+
+	std::ostringstream os;
+	os << "{\"bench\":\"push_back\",\"profile\":\"" << profile << "\",\"producers\":" << producers
+		<< ",\"messages\":" << per_producer * producers
+		<< ",\"messages_per_second\":" << per_producer * producers / elapsed << "}";
+	return os.str();
+}
+
+// latency of get_message over ranges of growing size
+std::string bench_range_read(bench_config const& config, size_t range_size)
+{
+	timax::queue_store store{ fresh_dir(config, "range_" + std::to_string(range_size)) };
+	std::string const value(config.message_size, 'x');
+	auto topic = store.open_topic("bench");
+
+	std::vector<std::string> messages(1000, value);
+	timax::queue_store::index_range range;
+	for (size_t i = 0; i < config.messages; i += messages.size())
+		store.push_back_many(topic, messages, range);
+
+	timax::queue_store::topic_info info;
+	store.get_topic_info(topic, info);
+
+	latency_samples latency;
+	size_t const reads = 1000;
+	for (size_t i = 0; i < reads; ++i)
+	{
+		auto first = info.head + (i * 7919) % (info.count > range_size ? info.count - range_size : 1);
+		std::string result;
+		result.reserve(range_size * (config.message_size + 1) + 2);
+
+		auto begin = bench_clock::now();
+		store.get_message(topic, first, first + range_size, result);
+		latency.add(bench_clock::now() - begin);
+	}
+
+	std::ostringstream os;
+	os << "{\"bench\":\"range_read\",\"range_size\":" << range_size
+		<< ",\"latency_us\":" << latency.to_json() << "}";
+	return os.str();
+}
+
+// producers and long polling consumers on the same topics for a while
+std::string bench_mixed(bench_config const& config, size_t producers, size_t consumers)
+{
+	timax::queue_store store{ fresh_dir(config, "mixed") };
+	std::string const value(config.message_size, 'x');
+	std::atomic<bool> stop{ false };
+	std::atomic<size_t> produced{ 0 }, consumed{ 0 };
+
+	std::vector<std::thread> threads;
+	for (size_t p = 0; p < producers; ++p)
+	{
+		threads.emplace_back([&, p]
+		{
+			auto topic = store.open_topic("mixed_" + std::to_string(p % consumers));
+			while (!stop)
+			{
+				if (store.push_back(topic, value))
+					++produced;
+			}
+		});
+	}
+
+	latency_samples latency;
+	std::mutex latency_mutex;
+	for (size_t c = 0; c < consumers; ++c)
+	{
+		threads.emplace_back([&, c]
+		{
+			std::vector<std::string> messages;
+			while (!stop)
+			{
+				messages.clear();
+				auto begin = bench_clock::now();
+				store.poll("bench", "mixed_" + std::to_string(c), 100, std::chrono::milliseconds{ 100 }, messages);
+				auto elapsed = bench_clock::now() - begin;
+				consumed += messages.size();
+
+				std::lock_guard<std::mutex> lock{ latency_mutex };
+				latency.add(elapsed);
+			}
+		});
+	}
+
+	auto const duration = std::chrono::seconds{ 5 };
+	std::this_thread::sleep_for(duration);
+	stop = true;
+	for (auto& t : threads)
+		t.join();
+
+	std::ostringstream os;
+	os << "{\"bench\":\"mixed\",\"producers\":" << producers << ",\"consumers\":" << consumers
+		<< ",\"produced_per_second\":" << produced / std::chrono::duration<double>(duration).count()
+		<< ",\"consumed_per_second\":" << consumed / std::chrono::duration<double>(duration).count()
+		<< ",\"poll_latency_us\":" << latency.to_json() << "}";
+	return os.str();
+}
+
+// incompressible like the images we store, every file is written twice to leave garbage behind;
+// write amplification is what flushes and compactions wrote over what was put; the blob files they
+// write are in those bytes already, their share is reported apart and not added again
+std::string bench_file_store(bench_config const& config, char const* profile,
+	timax::file_store_options options, size_t value_size)
+{
+	options.statistics = rocksdb::CreateDBStatistics();
+	auto statistics = options.statistics;
+	timax::file_store store{ fresh_dir(config, std::string{ "file_" } + profile + "_" + std::to_string(value_size)), options };
+
+	std::string value(value_size, '\0');
+	std::mt19937_64 random{ value_size };
+	for (auto& c : value)
+		c = static_cast<char>(random());
+
+	size_t const files = std::max<size_t>(std::min<size_t>(config.messages, (256u << 20) / value_size), 1);
+	size_t const rounds = 2;
+
+	latency_samples put_latency, get_latency;
+	auto put_begin = bench_clock::now();
+	for (size_t round = 0; round < rounds; ++round)
+	{
+		for (size_t i = 0; i < files; ++i)
+		{
+			auto begin = bench_clock::now();
+			store.put("file_" + std::to_string(i), value);
+			put_latency.add(bench_clock::now() - begin);
+		}
+	}
+	store.compact();
+	auto put_seconds = seconds_since(put_begin);
+
+	for (size_t i = 0; i < files; ++i)
+	{
+		auto begin = bench_clock::now();
+		store.get("file_" + std::to_string((i * 7919) % files));
+		get_latency.add(bench_clock::now() - begin);
+	}
+
+	std::map<std::string, uint64_t> tickers;
+	statistics->getTickerMap(&tickers);
+	double const user_bytes = static_cast<double>(rounds) * files * value_size;
+	double const written_bytes = static_cast<double>(tickers["rocksdb.flush.write.bytes"] +
+		tickers["rocksdb.compact.write.bytes"]);
+	double const blob_bytes = static_cast<double>(tickers["rocksdb.blobdb.blob.file.bytes.written"]);
+
+	std::ostringstream os;
+	os << "{\"bench\":\"file_store\",\"profile\":\"" << profile << "\",\"value_size\":" << value_size
+		<< ",\"files\":" << files
+		<< ",\"put_mb_per_second\":" << user_bytes / (1 << 20) / put_seconds
+		<< ",\"write_amplification\":" << written_bytes / user_bytes
+		<< ",\"blob_write_share\":" << (written_bytes > 0 ? blob_bytes / written_bytes : 0.0)
+		<< ",\"put_latency_us\":" << put_latency.to_json()
+		<< ",\"get_latency_us\":" << get_latency.to_json() << "}";
+	return os.str();
+}
+
+// a page of thumbnails, some of them missing: a get per key against one multi_get
+std::string bench_file_multi_get(bench_config const& config, size_t value_size, size_t batch_size)
+{
+	timax::file_store store{ fresh_dir(config, "file_multi_get_" + std::to_string(batch_size)) };
+	std::string const value(value_size, 'x');
+	size_t const files = std::max<size_t>(std::min<size_t>(config.messages, (256u << 20) / value_size), batch_size);
+	for (size_t i = 0; i < files; ++i)
+		store.put("thumb_" + std::to_string(i), value);
+	store.compact();
+
+	// one key in ten does not exist
+	std::mt19937_64 random{ batch_size };
+	auto page = [&]
+	{
+		std::vector<std::string> keys;
+		for (size_t i = 0; i < batch_size; ++i)
+			keys.push_back((0 == i % 10 ? "absent_" : "thumb_") + std::to_string(random() % files));
+		return keys;
+	};
+
+	size_t const pages = 1000;
+	latency_samples get_latency, multi_get_latency;
+	auto one_by_one = [&store, &get_latency](std::vector<std::string> const& keys)
+	{
+		auto begin = bench_clock::now();
+		for (auto const& key : keys)
+		{
+			rocksdb::PinnableSlice pinned;
+			store.try_get(key, pinned);
+		}
+		get_latency.add(bench_clock::now() - begin);
+	};
+
+	auto batched = [&store, &multi_get_latency](std::vector<std::string> const& keys)
+	{
+		std::vector<std::string> values;
+		auto begin = bench_clock::now();
+		store.multi_get(keys, values);
+		multi_get_latency.add(bench_clock::now() - begin);
+	};
+
+	// taking turns at going first, so neither always reads what the other just cached
+	for (size_t p = 0; p < pages; ++p)
+	{
+		auto keys = page();
+		if (0 == p % 2)
+		{
+			one_by_one(keys);
+			batched(keys);
+		}
+		else
+		{
+			batched(keys);
+			one_by_one(keys);
+		}
+	}
+
+	std::ostringstream os;
+	os << "{\"bench\":\"file_multi_get\",\"value_size\":" << value_size << ",\"batch_size\":" << batch_size
+		<< ",\"files\":" << files
+		<< ",\"try_get_page_latency_us\":" << get_latency.to_json()
+		<< ",\"multi_get_page_latency_us\":" << multi_get_latency.to_json() << "}";
+	return os.str();
+}
+
+int main(int argc, char* argv[])
+{
+	auto arg = [argc, argv](size_t index, size_t default_value)
+	{
+		return static_cast<int>(index) < argc ? std::stoul(argv[index]) : default_value;
+	};
+
+	bench_config config;
+	std::filesystem::path root = static_cast<int>(store_bench_dir_index) < argc ?
+		std::filesystem::path{ argv[store_bench_dir_index] } : std::filesystem::temp_directory_path();
+	config.dir = (root / "timax_store_bench").string();
+	config.messages = arg(store_bench_messages_index, config.messages);
+	config.message_size = arg(store_bench_size_index, config.message_size);
+	std::filesystem::create_directories(config.dir);
+
+	timax::queue_store_options defaults;
+	timax::queue_store_options tuned;
+	tuned.tuning.enabled = true;
+	timax::queue_store_options grouped;
+	grouped.group_commit.enabled = true;
+	timax::queue_store_options plain;
+	plain.engine = timax::queue_engine::plain;
+	timax::queue_store_options single_writer;
+	single_writer.engine = timax::queue_engine::single_writer;
+
+	std::vector<std::string> results;
+	auto const max_producers = std::max(1u, std::thread::hardware_concurrency());
+	for (size_t producers = 1; producers <= max_producers; producers *= 2)
+	{
+		results.push_back(bench_push_back(config, "default", defaults, producers));
+		results.push_back(bench_push_back(config, "tuned", tuned, producers));
+		results.push_back(bench_push_back(config, "group_commit", grouped, producers));
+		results.push_back(bench_push_back(config, "plain", plain, producers));
+		results.push_back(bench_push_back(config, "single_writer", single_writer, producers));
+	}
+
+	for (size_t range_size : { 1, 10, 100, 1000 })
+		results.push_back(bench_range_read(config, range_size));
+
+	results.push_back(bench_mixed(config, 4, 2));
+
+	// typical images, before and after moving payloads to blob files
+	timax::file_store_options lsm;
+	timax::file_store_options blob;
+	blob.blob.enabled = true;
+	for (size_t value_size : { 1u << 10, 100u << 10, 1u << 20, 10u << 20 })
+	{
+		results.push_back(bench_file_store(config, "lsm", lsm, value_size));
+		results.push_back(bench_file_store(config, "blob", blob, value_size));
+	}
+
+	for (size_t batch_size : { 10, 50, 200 })
+		results.push_back(bench_file_multi_get(config, 10 << 10, batch_size));
+
+	std::cout << "[" << std::endl;
+	for (size_t i = 0; i < results.size(); ++i)
+		std::cout << "  " << results[i] << (i + 1 < results.size() ? "," : "") << std::endl;
+	std::cout << "]" << std::endl;
+
+	std::filesystem::remove_all(config.dir);
+	return 0;
+}
\ No newline at end of file
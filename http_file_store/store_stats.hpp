@@ -0,0 +1,377 @@
+#pragma once
+
+#include <map>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstdint>
+#include <cctype>
+#include <algorithm>
+#include <rocksdb/perf_context.h>
+#include <rocksdb/perf_level.h>
+#include <rocksdb/statistics.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace timax
+{
+	namespace detail
+	{
+		inline int highest_bit(uint64_t value) noexcept
+		{
+#ifdef _MSC_VER
+			unsigned long index;
+			_BitScanReverse64(&index, value);
+			return static_cast<int>(index);
+#else
+			return 63 - __builtin_clzll(value);
+#endif
+		}
+	}
+
+	/* copy of a latency_histogram, values are nanoseconds */
+	struct histogram_snapshot
+	{
+		uint64_t						count = 0;
+		uint64_t						sum = 0;
+		uint64_t						max = 0;
+		std::vector<uint64_t>			buckets;
+
+		double mean() const noexcept
+		{
+			return 0 == count ? 0.0 : static_cast<double>(sum) / count;
+		}
+
+		// upper bound of the bucket holding the p-th quantile, p in [0, 1]
+		uint64_t percentile(double p) const noexcept;
+	};
+
+	/* log-linear buckets like HDR histogram: 8 sub buckets per power of two, ~12.5% precision,
+	   recording is a few relaxed atomic adds */
+	class latency_histogram
+	{
+	public:
+		static constexpr int sub_bucket_bits = 3;
+		static constexpr uint64_t sub_bucket_count = 1u << sub_bucket_bits;
+		static constexpr size_t bucket_count = 64 << sub_bucket_bits;
+
+		void record(uint64_t value) noexcept
+		{
+			buckets_[index_of(value)].fetch_add(1, std::memory_order_relaxed);
+			count_.fetch_add(1, std::memory_order_relaxed);
+			sum_.fetch_add(value, std::memory_order_relaxed);
+
+			auto max = max_.load(std::memory_order_relaxed);
+			while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed))
+			{
+			}
+		}
+
+		histogram_snapshot snapshot() const
+		{
+			histogram_snapshot s;
+			s.count = count_.load(std::memory_order_relaxed);
+			s.sum = sum_.load(std::memory_order_relaxed);
+			s.max = max_.load(std::memory_order_relaxed);
+			s.buckets.reserve(bucket_count);
+			for (auto const& bucket : buckets_)
+				s.buckets.push_back(bucket.load(std::memory_order_relaxed));
+			return s;
+		}
+
+		static size_t index_of(uint64_t value) noexcept
+		{
+			if (value < sub_bucket_count)
+				return static_cast<size_t>(value);
+
+			auto shift = detail::highest_bit(value) - sub_bucket_bits;
+			auto sub_bucket = (value >> shift) - sub_bucket_count;
+			return static_cast<size_t>(((shift + 1) << sub_bucket_bits) + sub_bucket);
+		}
+
+		static uint64_t upper_bound_of(size_t index) noexcept
+		{
+			if (index < sub_bucket_count)
+				return index;
+
+			auto shift = (index >> sub_bucket_bits) - 1;
+			auto sub_bucket = index & (sub_bucket_count - 1);
+			return ((sub_bucket_count + sub_bucket + 1) << shift) - 1;
+		}
+
+	private:
+		std::array<std::atomic<uint64_t>, bucket_count>	buckets_ = {};
+		std::atomic<uint64_t>							count_{ 0 };
+		std::atomic<uint64_t>							sum_{ 0 };
+		std::atomic<uint64_t>							max_{ 0 };
+	};
+
+	inline uint64_t histogram_snapshot::percentile(double p) const noexcept
+	{
+		if (0 == count)
+			return 0;
+
+		auto rank = static_cast<uint64_t>(p * count);
+		uint64_t seen = 0;
+		for (size_t i = 0; i < buckets.size(); ++i)
+		{
+			seen += buckets[i];
+			if (seen > rank)
+				return std::min(latency_histogram::upper_bound_of(i), max);
+		}
+		return max;
+	}
+
+	/* records the lifetime of the scope into a histogram, a null histogram costs nothing */
+	class scoped_latency
+	{
+		using clock = std::chrono::steady_clock;
+
+	public:
+		explicit scoped_latency(latency_histogram* histogram) noexcept
+			: histogram_(histogram)
+		{
+			if (histogram_)
+				begin_ = clock::now();
+		}
+
+		scoped_latency(scoped_latency const&) = delete;
+		scoped_latency& operator= (scoped_latency const&) = delete;
+
+		~scoped_latency()
+		{
+			if (histogram_)
+			{
+				auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - begin_);
+				histogram_->record(static_cast<uint64_t>(elapsed.count()));
+			}
+		}
+
+	private:
+		latency_histogram*			histogram_;
+		clock::time_point			begin_;
+	};
+
+	/* rocksdb PerfContext is per thread, instrumented calls add theirs up here */
+	class perf_totals
+	{
+	public:
+		void add(rocksdb::PerfContext const& perf) noexcept
+		{
+			add(write_wal_nanos_, perf.write_wal_time);
+			add(write_memtable_nanos_, perf.write_memtable_time);
+			add(write_delay_nanos_, perf.write_delay_time);
+			add(key_lock_wait_nanos_, perf.key_lock_wait_time);
+			add(get_from_memtable_nanos_, perf.get_from_memtable_time);
+			add(seek_on_memtable_nanos_, perf.seek_on_memtable_time);
+			add(block_read_nanos_, perf.block_read_time);
+			add(block_read_count_, perf.block_read_count);
+			add(internal_key_skipped_count_, perf.internal_key_skipped_count);
+			add(internal_delete_skipped_count_, perf.internal_delete_skipped_count);
+		}
+
+		std::map<std::string, uint64_t> snapshot() const
+		{
+			return {
+				{ "write_wal_nanos", write_wal_nanos_.load() },
+				{ "write_memtable_nanos", write_memtable_nanos_.load() },
+				{ "write_delay_nanos", write_delay_nanos_.load() },
+				{ "key_lock_wait_nanos", key_lock_wait_nanos_.load() },
+				{ "get_from_memtable_nanos", get_from_memtable_nanos_.load() },
+				{ "seek_on_memtable_nanos", seek_on_memtable_nanos_.load() },
+				{ "block_read_nanos", block_read_nanos_.load() },
+				{ "block_read_count", block_read_count_.load() },
+				{ "internal_key_skipped_count", internal_key_skipped_count_.load() },
+				{ "internal_delete_skipped_count", internal_delete_skipped_count_.load() },
+			};
+		}
+
+	private:
+		static void add(std::atomic<uint64_t>& total, uint64_t value) noexcept
+		{
+			if (value > 0)
+				total.fetch_add(value, std::memory_order_relaxed);
+		}
+
+	private:
+		std::atomic<uint64_t>		write_wal_nanos_{ 0 };
+		std::atomic<uint64_t>		write_memtable_nanos_{ 0 };
+		std::atomic<uint64_t>		write_delay_nanos_{ 0 };
+		std::atomic<uint64_t>		key_lock_wait_nanos_{ 0 };
+		std::atomic<uint64_t>		get_from_memtable_nanos_{ 0 };
+		std::atomic<uint64_t>		seek_on_memtable_nanos_{ 0 };
+		std::atomic<uint64_t>		block_read_nanos_{ 0 };
+		std::atomic<uint64_t>		block_read_count_{ 0 };
+		std::atomic<uint64_t>		internal_key_skipped_count_{ 0 };
+		std::atomic<uint64_t>		internal_delete_skipped_count_{ 0 };
+	};
+
+	/* collects the PerfContext of the calling thread for the lifetime of the scope */
+	class scoped_perf_context
+	{
+	public:
+		explicit scoped_perf_context(perf_totals* totals) noexcept
+			: totals_(totals)
+		{
+			if (totals_)
+			{
+				level_ = rocksdb::GetPerfLevel();
+				rocksdb::SetPerfLevel(rocksdb::PerfLevel::kEnableTimeExceptForMutex);
+				rocksdb::get_perf_context()->Reset();
+			}
+		}
+
+		scoped_perf_context(scoped_perf_context const&) = delete;
+		scoped_perf_context& operator= (scoped_perf_context const&) = delete;
+
+		~scoped_perf_context()
+		{
+			if (totals_)
+			{
+				totals_->add(*rocksdb::get_perf_context());
+				rocksdb::SetPerfLevel(level_);
+			}
+		}
+
+	private:
+		perf_totals*				totals_;
+		rocksdb::PerfLevel			level_ = rocksdb::PerfLevel::kDisable;
+	};
+
+	struct stats_options
+	{
+		bool						latency = true;				// per operation histograms
+		bool						rocksdb_statistics = false;	// DBOptions::statistics, costs a few percent
+		bool						perf_context = false;		// PerfContext of every instrumented call
+	};
+
+	struct topic_stats
+	{
+		std::string					topic;
+		uint64_t					head = 0;
+		uint64_t					tail = 0;
+		uint64_t					bytes = 0;
+		uint64_t					appended_messages = 0;
+		uint64_t					appended_bytes = 0;
+		uint64_t					commit_failures = 0;
+		uint64_t					conflict_retries = 0;
+	};
+
+	/* point in time copy of the store statistics */
+	struct store_stats
+	{
+		std::map<std::string, histogram_snapshot>	latencies;			// nanoseconds by operation
+		std::vector<topic_stats>					topics;
+		std::map<std::string, uint64_t>				counters;			// store wide, monotonic
+		std::map<std::string, uint64_t>				rocksdb_tickers;
+		std::map<std::string, uint64_t>				perf_context;
+
+		std::string to_text() const
+		{
+			std::ostringstream os;
+			for (auto const& latency : latencies)
+			{
+				auto const& h = latency.second;
+				os << latency.first << ": count=" << h.count << " mean_ns=" << static_cast<uint64_t>(h.mean())
+					<< " p50_ns=" << h.percentile(0.5) << " p99_ns=" << h.percentile(0.99)
+					<< " p999_ns=" << h.percentile(0.999) << " max_ns=" << h.max << "\n";
+			}
+			for (auto const& t : topics)
+			{
+				os << "topic " << t.topic << ": head=" << t.head << " tail=" << t.tail << " bytes=" << t.bytes
+					<< " appended_messages=" << t.appended_messages << " appended_bytes=" << t.appended_bytes
+					<< " commit_failures=" << t.commit_failures << " conflict_retries=" << t.conflict_retries << "\n";
+			}
+			for (auto const& counter : counters)
+				os << counter.first << ": " << counter.second << "\n";
+			for (auto const& perf : perf_context)
+				os << "perf " << perf.first << ": " << perf.second << "\n";
+			for (auto const& ticker : rocksdb_tickers)
+				os << ticker.first << ": " << ticker.second << "\n";
+			return os.str();
+		}
+
+		// prometheus text exposition format
+		std::string to_prometheus(std::string const& prefix = "timax_queue") const
+		{
+			std::ostringstream os;
+
+			os << "# TYPE " << prefix << "_latency_seconds summary\n";
+			for (auto const& latency : latencies)
+			{
+				auto const& h = latency.second;
+				auto label = "op=\"" + escape(latency.first) + "\"";
+				for (double q : { 0.5, 0.9, 0.99, 0.999 })
+				{
+					os << prefix << "_latency_seconds{" << label << ",quantile=\"" << q << "\"} "
+						<< h.percentile(q) / 1e9 << "\n";
+				}
+				os << prefix << "_latency_seconds_sum{" << label << "} " << h.sum / 1e9 << "\n";
+				os << prefix << "_latency_seconds_count{" << label << "} " << h.count << "\n";
+			}
+
+			auto topic_metric = [&](char const* name, char const* type, auto member)
+			{
+				os << "# TYPE " << prefix << "_topic_" << name << " " << type << "\n";
+				for (auto const& t : topics)
+					os << prefix << "_topic_" << name << "{topic=\"" << escape(t.topic) << "\"} " << t.*member << "\n";
+			};
+			topic_metric("head", "gauge", &topic_stats::head);
+			topic_metric("tail", "gauge", &topic_stats::tail);
+			topic_metric("bytes", "gauge", &topic_stats::bytes);
+			topic_metric("appended_messages_total", "counter", &topic_stats::appended_messages);
+			topic_metric("appended_bytes_total", "counter", &topic_stats::appended_bytes);
+			topic_metric("commit_failures_total", "counter", &topic_stats::commit_failures);
+			topic_metric("conflict_retries_total", "counter", &topic_stats::conflict_retries);
+
+			for (auto const& counter : counters)
+			{
+				os << "# TYPE " << prefix << "_" << counter.first << "_total counter\n";
+				os << prefix << "_" << counter.first << "_total " << counter.second << "\n";
+			}
+
+			for (auto const& perf : perf_context)
+			{
+				os << "# TYPE " << prefix << "_perf_" << perf.first << " counter\n";
+				os << prefix << "_perf_" << perf.first << " " << perf.second << "\n";
+			}
+
+			// rocksdb.block.cache.miss -> <prefix>_rocksdb_block_cache_miss
+			for (auto const& ticker : rocksdb_tickers)
+			{
+				auto name = prefix + "_" + ticker.first;
+				for (auto& c : name)
+				{
+					if (!std::isalnum(static_cast<unsigned char>(c)))
+						c = '_';
+				}
+				os << "# TYPE " << name << " counter\n" << name << " " << ticker.second << "\n";
+			}
+
+			return os.str();
+		}
+
+	private:
+		static std::string escape(std::string const& value)
+		{
+			std::string escaped;
+			escaped.reserve(value.size());
+			for (auto c : value)
+			{
+				if ('\\' == c || '"' == c)
+					escaped.push_back('\\');
+				if ('\n' == c)
+				{
+					escaped += "\\n";
+					continue;
+				}
+				escaped.push_back(c);
+			}
+			return escaped;
+		}
+	};
+}